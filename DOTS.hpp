@@ -1,20 +1,140 @@
 #include <stdint.h>
 #include <stdexcept>
-#include <bitset>
 #include <limits>
 #include <cstring>
+#include <cstddef>
 #include <type_traits>
 #include <functional>
+#include <memory>
+#include <new>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <cmath>
+#include <initializer_list>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
 #include <atomic>
 #include <algorithm>
+#include <cstdio>
+#include <string>
+#ifdef DOTS_PROFILE
+#include <chrono>
+#endif
+#ifdef DOTS_SAFETY_CHECKS
+#include <cstdlib>
+#endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // By José Ignacio Huby Ochoa
 
 namespace DOTS{
+// Components deriving from SharedComponent are stored once per chunk instead of once per entity, and the
+// entities of an archetype are grouped into chunks by their shared values, compared byte by byte.
+struct SharedComponent{};
+
+// Archetype signatures have one bit per component type. Up to 64 components they are plain integers,
+// wider ones are arrays of 64-bit words that the compiler can vectorize over.
+template<unsigned WORDS>
+struct WideSignature{
+        uint64_t word[WORDS];
+
+        constexpr WideSignature(): word{}{}
+        constexpr WideSignature operator|(const WideSignature& other) const {
+                WideSignature result;
+                for(unsigned i = 0; i<WORDS; ++i) result.word[i] = word[i] | other.word[i];
+                return result;
+        }
+        constexpr WideSignature operator&(const WideSignature& other) const {
+                WideSignature result;
+                for(unsigned i = 0; i<WORDS; ++i) result.word[i] = word[i] & other.word[i];
+                return result;
+        }
+        constexpr WideSignature operator^(const WideSignature& other) const {
+                WideSignature result;
+                for(unsigned i = 0; i<WORDS; ++i) result.word[i] = word[i] ^ other.word[i];
+                return result;
+        }
+        constexpr WideSignature operator~() const {
+                WideSignature result;
+                for(unsigned i = 0; i<WORDS; ++i) result.word[i] = ~word[i];
+                return result;
+        }
+        constexpr WideSignature& operator|=(const WideSignature& other){
+                for(unsigned i = 0; i<WORDS; ++i) word[i] |= other.word[i];
+                return *this;
+        }
+        constexpr WideSignature& operator&=(const WideSignature& other){
+                for(unsigned i = 0; i<WORDS; ++i) word[i] &= other.word[i];
+                return *this;
+        }
+        constexpr bool operator==(const WideSignature& other) const {
+                uint64_t difference = 0;
+                for(unsigned i = 0; i<WORDS; ++i) difference |= word[i] ^ other.word[i];
+                return difference == 0;
+        }
+        constexpr bool operator!=(const WideSignature& other) const {
+                return !(*this == other);
+        }
+        constexpr bool operator<(const WideSignature& other) const {
+                for(unsigned i = 0; i<WORDS; ++i) if(word[i] != other.word[i]) return word[i] < other.word[i];
+                return false;
+        }
+        constexpr explicit operator bool() const {
+                uint64_t any = 0;
+                for(unsigned i = 0; i<WORDS; ++i) any |= word[i];
+                return any != 0;
+        }
+};
+
+template<typename Signature>
+struct SignatureTraits{
+        static constexpr Signature bit(const unsigned i){
+                return Signature(1) << i;
+        }
+        static constexpr bool contains(const Signature set, const Signature subset){
+                return (set & subset) == subset;
+        }
+        static constexpr size_t hash(const Signature signature){
+                return signature;
+        }
+};
+
+template<unsigned WORDS>
+struct SignatureTraits<WideSignature<WORDS>>{
+        static constexpr WideSignature<WORDS> bit(const unsigned i){
+                WideSignature<WORDS> signature;
+                signature.word[i/64] = uint64_t(1) << (i%64);
+                return signature;
+        }
+        static constexpr bool contains(const WideSignature<WORDS>& set, const WideSignature<WORDS>& subset){
+                uint64_t missing = 0;
+                for(unsigned i = 0; i<WORDS; ++i) missing |= subset.word[i] & ~set.word[i];
+                return missing == 0;
+        }
+        static constexpr size_t hash(const WideSignature<WORDS>& signature){
+                uint64_t hash = 0;
+                for(unsigned i = 0; i<WORDS; ++i) hash = (hash ^ signature.word[i])*0x9E3779B97F4A7C15ull;
+                return hash ^ (hash >> 32);
+        }
+};
+
+template<unsigned COMPONENTS>
+using Signature = std::conditional_t<COMPONENTS <= 32, uint32_t, std::conditional_t<COMPONENTS <= 64, uint64_t, WideSignature<(COMPONENTS + 63)/64>>>;
+
         namespace{
                 constexpr bool isPrime(uint16_t n) noexcept {
                         if (n <= 1) return false;
@@ -25,6 +145,14 @@ namespace DOTS{
                         do{++n;} while(!isPrime(n));
                         return n;
                 }
+                constexpr unsigned bitWidth(uint32_t n) noexcept {
+                        unsigned bits = 0;
+                        while(n != 0){++bits; n >>= 1;}
+                        return bits;
+                }
+                constexpr unsigned alignUp(unsigned n, unsigned alignment) noexcept {
+                        return (n + alignment - 1)/alignment*alignment;
+                }
 
                 template<typename T, typename... Ts>
                 struct getTypeIndex;
@@ -39,6 +167,33 @@ namespace DOTS{
                 static constexpr uint8_t value = 0;
                 };
 
+                // Empty components are tags, they only take part in the archetype and get no storage.
+                template<typename T>
+                struct isTagComponent{
+                        static constexpr bool value = std::is_empty<T>::value;
+                };
+
+                template<typename T>
+                struct isSharedComponent{
+                        static constexpr bool value = std::is_base_of<SharedComponent, T>::value && !std::is_empty<T>::value;
+                };
+
+                template<typename Archetype, typename... Ts>
+                constexpr Archetype sharedArchetype() noexcept {
+                        const bool shared[] = {isSharedComponent<Ts>::value..., false};
+                        Archetype archetype{};
+                        for(unsigned i = 0; i<sizeof...(Ts); ++i) if(shared[i]) archetype |= SignatureTraits<Archetype>::bit(i);
+                        return archetype;
+                }
+
+                template<typename... Ts>
+                constexpr unsigned sharedSize() noexcept {
+                        const unsigned sizes[] = {(isSharedComponent<Ts>::value ? (unsigned)sizeof(Ts) : 0u)..., 0u};
+                        unsigned size = 0;
+                        for(unsigned i = 0; i<sizeof...(Ts); ++i) size += sizes[i];
+                        return size;
+                }
+
                 template<typename... Ts>
                 struct isTypePresent{
                         static constexpr bool value = false;
@@ -56,395 +211,2536 @@ namespace DOTS{
         };
 
 using EntityID = uint32_t;
-using Archetype = uint32_t;
 
-template<uint16_t MAX_ENTITIES, uint16_t MAX_CHUNKS, uint16_t CHUNK_SIZE, typename... Components>
+struct JobHandle{
+        const void* job = nullptr;
+        uint32_t generation = 0;
+};
+
+#ifdef DOTS_PROFILE
+// Opt-in instrumentation, compiled in only when DOTS_PROFILE is defined. Every thread records spans into its own
+// ring of EVENTS_PER_THREAD, keeping the latest ones, so recording neither contends nor allocates. Counters are
+// relaxed atomics. Export at a sync point to get a consistent frame.
+class Profiler{
+        public:
+        static constexpr unsigned EVENTS_PER_THREAD = 1 << 16;
+        enum Counter : unsigned {ENTITIES_CREATED, ENTITIES_DESTROYED, ENTITIES_TRANSFERRED, CHUNKS_ALLOCATED, CHUNKS_RELEASED, COUNTERS};
+        static constexpr uint32_t NO_WORKER = std::numeric_limits<uint32_t>::max();
+        // Times are nanoseconds since the profiler started, wait is how long a job sat ready in a queue.
+        struct Event{
+                const char* name;
+                uint64_t start;
+                uint64_t end;
+                uint64_t wait;
+                uint32_t worker;
+        };
+
+        private:
+        struct ThreadEvents{
+                std::unique_ptr<Event[]> events{new Event[EVENTS_PER_THREAD]};
+                uint64_t recorded = 0;
+                std::atomic_flag lock = ATOMIC_FLAG_INIT;
+                std::string name;
+        };
+        struct CounterSample{
+                uint64_t time;
+                uint64_t values[COUNTERS];
+        };
+        const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        std::atomic<bool> enabled{true};
+        std::atomic<uint64_t> counters[COUNTERS] = {};
+        std::mutex threads_lock;
+        std::vector<std::unique_ptr<ThreadEvents>> threads;
+        std::vector<CounterSample> samples;
+
+        // Buffers outlive their threads so spans of finished threads can still be exported.
+        inline ThreadEvents& threadEvents(){
+                static thread_local ThreadEvents* events = nullptr;
+                if(events == nullptr){
+                        std::lock_guard<std::mutex> lg(threads_lock);
+                        threads.emplace_back(new ThreadEvents);
+                        events = threads.back().get();
+                        events->name = "thread " + std::to_string(threads.size() - 1);
+                }
+                return *events;
+        }
+
+        static inline void lockEvents(ThreadEvents& events){
+                while(events.lock.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+        }
+
+        static inline void unlockEvents(ThreadEvents& events){
+                events.lock.clear(std::memory_order_release);
+        }
+
+        static inline void appendEscaped(std::string& out, const char* text){
+                for(; *text != '\0'; ++text){
+                        if(*text == '"' || *text == '\\') out += '\\';
+                        if((unsigned char)*text >= 0x20) out += *text;
+                }
+        }
+
+        inline void sampleCountersLocked(){
+                CounterSample sample{now(), {}};
+                for(unsigned i = 0; i<COUNTERS; ++i) sample.values[i] = counters[i].load(std::memory_order_relaxed);
+                samples.push_back(sample);
+        }
+
+        public:
+        static inline Profiler& instance(){
+                static Profiler profiler;
+                return profiler;
+        }
+        inline uint64_t now() const {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+        }
+        inline bool isEnabled() const {
+                return enabled.load(std::memory_order_relaxed);
+        }
+        // Spans are not recorded while disabled, counters keep counting.
+        inline void enable(const bool enable){
+                enabled.store(enable, std::memory_order_relaxed);
+        }
+        inline void nameThread(const std::string& name){
+                ThreadEvents& events = threadEvents();
+                lockEvents(events);
+                events.name = name;
+                unlockEvents(events);
+        }
+        inline void record(const char* name, const uint64_t start, const uint64_t end, const uint64_t wait = 0, const uint32_t worker = NO_WORKER){
+                if(!isEnabled()) return;
+                ThreadEvents& events = threadEvents();
+                lockEvents(events);
+                events.events[events.recorded++ % EVENTS_PER_THREAD] = Event{name, start, end, wait, worker};
+                unlockEvents(events);
+        }
+        inline void count(const Counter counter, const uint64_t n = 1){
+                counters[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+        inline uint64_t counter(const Counter counter) const {
+                return counters[counter].load(std::memory_order_relaxed);
+        }
+        // Adds the current counter values to the trace, once per frame for instance.
+        inline void sampleCounters(){
+                std::lock_guard<std::mutex> lg(threads_lock);
+                sampleCountersLocked();
+        }
+        // The name jobs scheduled on this thread get, set by ProfileScope.
+        static inline const char*& label(){
+                static thread_local const char* name = nullptr;
+                return name;
+        }
+        // Drops the recorded spans and counter samples, counters are not reset.
+        inline void clear(){
+                std::lock_guard<std::mutex> lg(threads_lock);
+                for(auto& events : threads){
+                        lockEvents(*events);
+                        events->recorded = 0;
+                        unlockEvents(*events);
+                }
+                samples.clear();
+        }
+        // Writes the spans and counter samples, plus a last sample of the counters, as Chrome trace JSON
+        // (chrome://tracing or ui.perfetto.dev).
+        inline void exportChromeTrace(const char* path){
+                static const char* COUNTER_NAMES[COUNTERS] = {"created", "destroyed", "transferred", "chunks_allocated", "chunks_released"};
+                std::string out = "{\"traceEvents\":[\n";
+                char number[128];
+                std::lock_guard<std::mutex> lg(threads_lock);
+                sampleCountersLocked();
+                for(unsigned t = 0; t<threads.size(); ++t){
+                        ThreadEvents& events = *threads[t];
+                        lockEvents(events);
+                        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" + std::to_string(t) + ",\"args\":{\"name\":\"";
+                        appendEscaped(out, events.name.c_str());
+                        out += "\"}},\n";
+                        const uint64_t first = events.recorded < EVENTS_PER_THREAD ? 0 : events.recorded - EVENTS_PER_THREAD;
+                        for(uint64_t e = first; e<events.recorded; ++e){
+                                const Event& event = events.events[e % EVENTS_PER_THREAD];
+                                out += "{\"name\":\"";
+                                appendEscaped(out, event.name);
+                                std::snprintf(number, sizeof(number), "\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", t, event.start/1000.0, (event.end - event.start)/1000.0);
+                                out += number;
+                                if(event.worker != NO_WORKER){
+                                        std::snprintf(number, sizeof(number), ",\"args\":{\"worker\":%u,\"queue_wait_us\":%.3f}", event.worker, event.wait/1000.0);
+                                        out += number;
+                                }
+                                out += "},\n";
+                        }
+                        unlockEvents(events);
+                }
+                for(const CounterSample& sample : samples){
+                        std::snprintf(number, sizeof(number), "{\"name\":\"entities\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{", sample.time/1000.0);
+                        out += number;
+                        for(unsigned i = 0; i<COUNTERS; ++i){
+                                out += (i == 0 ? "\"" : ",\"") + std::string(COUNTER_NAMES[i]) + "\":" + std::to_string(sample.values[i]);
+                        }
+                        out += "}},\n";
+                }
+                out.erase(out.size() - 2);
+                out += "\n]}\n";
+                samples.pop_back();
+                FILE* file = std::fopen(path, "wb");
+                if(file == nullptr) throw std::runtime_error("Can't open trace!");
+                const bool written = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+                if(std::fclose(file) != 0 || !written) throw std::runtime_error("Can't write trace!");
+        }
+};
+
+// Records a span for the enclosing scope and names the jobs scheduled inside it after it.
+class ProfileScope{
+        const char* name;
+        const char* previous;
+        uint64_t start;
+
+        public:
+        ProfileScope(const char* _name):name{_name}, previous{Profiler::label()}, start{Profiler::instance().now()}{
+                Profiler::label() = name;
+        }
+        ~ProfileScope(){
+                Profiler::label() = previous;
+                Profiler::instance().record(name, start, Profiler::instance().now());
+        }
+};
+
+#define DOTS_PROFILE_CONCAT_(a, b) a##b
+#define DOTS_PROFILE_CONCAT(a, b) DOTS_PROFILE_CONCAT_(a, b)
+#define DOTS_PROFILE_SCOPE(name) DOTS::ProfileScope DOTS_PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define DOTS_PROFILE_COUNT(counter, n) DOTS::Profiler::instance().count(DOTS::Profiler::counter, n)
+#else
+#define DOTS_PROFILE_SCOPE(name)
+#define DOTS_PROFILE_COUNT(counter, n)
+#endif
+
+// An EntityID packs the index of the entity's slot in its low bits and the generation of that slot in the rest.
+// Destroying an entity bumps its slot's generation, so ids kept after that no longer match the slot.
+template<uint32_t MAX_ENTITIES, uint16_t MAX_CHUNKS, uint16_t CHUNK_SIZE, typename... Components>
 class Entities{
-        
-        static constexpr uint16_t MAP_CAPACITY_ENTITIES = FirstGreaterPrime(MAX_ENTITIES);
+        static_assert(sizeof...(Components) < 256, "Too many component types");
+        using Archetype = Signature<sizeof...(Components)>;
+
+        static constexpr unsigned ENTITY_INDEX_BITS = bitWidth(MAX_ENTITIES - 1);
+        static constexpr EntityID ENTITY_INDEX_MASK = (EntityID(1) << ENTITY_INDEX_BITS) - 1;
+        static constexpr EntityID ENTITY_GENERATION_MASK = ~ENTITY_INDEX_MASK;
+        static constexpr EntityID ENTITY_GENERATION_ONE = ENTITY_INDEX_MASK + 1;
+        static_assert(32 - ENTITY_INDEX_BITS >= 8, "MAX_ENTITIES leaves less than 8 bits for entity generations");
+        static constexpr uint32_t MIN_FREE_ENTITY_INDEXES = std::min<uint32_t>(1024, MAX_ENTITIES/4);
+        static constexpr uint16_t NO_CHUNK = std::numeric_limits<uint16_t>::max();
+        static_assert(MAX_CHUNKS < NO_CHUNK, "MAX_CHUNKS is too large");
         static constexpr uint16_t MAP_CAPACITY_ARCHETYPES = FirstGreaterPrime(MAX_CHUNKS);
-        static constexpr uint16_t CHUNK_BUFFER_SIZE = CHUNK_SIZE - 2 - 2 - 4 - 4 - 4*sizeof...(Components);
-        static constexpr uint16_t COMPONENT_SIZE[] = {sizeof(Components)...,};
+        static constexpr unsigned CHUNK_ALIGNMENT = 4096;
+        static constexpr unsigned CHUNK_POOL_CACHE = 16;
+        static constexpr unsigned COLUMN_ALIGNMENT = 64;
+        static constexpr unsigned COLUMN_ROWS_MULTIPLE = 16;
+        static constexpr uint16_t COMPONENT_SIZE[] = {(isTagComponent<Components>::value ? 0 : sizeof(Components))...,};
+        // Bytes each row takes in a column, nothing for tags and shared components.
+        static constexpr uint16_t COLUMN_SIZE[] = {(isTagComponent<Components>::value || isSharedComponent<Components>::value ? 0 : sizeof(Components))...,};
+        static constexpr Archetype SHARED_ARCHETYPE = sharedArchetype<Archetype, Components...>();
+        static constexpr unsigned SHARED_VALUE_ALIGNMENT = alignof(std::max_align_t);
+        static constexpr unsigned PARALLEL_FOR_MIN_BATCH = 64;
+        static constexpr unsigned PARALLEL_FOR_BATCHES_PER_WORKER = 4;
 
-        #define MAP_UNUSED_SPACE 0
-        #define MAP_DIRTY_SPACE std::numeric_limits<uint16_t>::max()
+        #define MAP_UNUSED_SPACE Archetype()
+        static constexpr uint32_t NO_COLUMN = std::numeric_limits<uint32_t>::max();
 
         struct EntityPosition{
-                uint16_t archetype_index;
+                uint16_t chunk;
                 uint16_t chunk_row;
         };
-        struct Chunk{
+        // Where the columns of an archetype live inside its chunks. Every chunk of the archetype shares it, so
+        // chunk headers stay the same size whatever the amount of component types.
+        struct ColumnLayout{
+                uint16_t capacity;
+                uint16_t columns;
+                uint32_t ids;
+                uint32_t versions;
+                uint32_t offset[sizeof...(Components)];
+                uint16_t slot[sizeof...(Components)];
+        };
+        struct ChunkHeader{
                 uint16_t size;
                 uint16_t capacity;
-                uint16_t* index;
+                uint16_t archetype_index;
+                uint16_t list_index;
+                const ColumnLayout* layout;
                 EntityID* id;
-                uint8_t* component[sizeof...(Components)];
-                uint8_t buffer[CHUNK_BUFFER_SIZE];
+                // Change version of the last write to each present column, see Entities::nextChangeVersion.
+                std::atomic<uint32_t>* versions;
+        };
+        static constexpr unsigned CHUNK_BUFFER_SIZE = CHUNK_SIZE - alignUp(sizeof(ChunkHeader), COLUMN_ALIGNMENT);
+        struct Chunk : ChunkHeader{
+                alignas(COLUMN_ALIGNMENT) uint8_t buffer[CHUNK_BUFFER_SIZE];
+
+                // Null when the archetype lacks the component.
+                inline uint8_t* component(const unsigned i) const {
+                        const uint32_t offset = this->layout->offset[i];
+                        return offset == NO_COLUMN ? nullptr : const_cast<uint8_t*>(buffer) + offset;
+                }
+                inline std::atomic<uint32_t>& version(const unsigned i) const {
+                        return this->versions[this->layout->slot[i]];
+                }
+        };
+        static_assert(sizeof(Chunk) == CHUNK_SIZE, "CHUNK_SIZE must be a multiple of 64");
+        // Chunks of one archetype, the full ones first so a chunk with room is found in constant time.
+        struct ColumnCopy{
+                uint32_t from;
+                uint32_t to;
+                uint32_t size;
+        };
+        enum EdgeKind : uint8_t {EDGE_ADD, EDGE_DEL, EDGE_MOVE};
+        static constexpr uint16_t NO_TARGET = std::numeric_limits<uint16_t>::max();
+        // A cached step from one archetype to another by adding or removing the components in change, or a
+        // direct move to change itself. target is NO_TARGET when no component is left. copies are the columns
+        // both archetypes store per row.
+        struct ArchetypeEdge{
+                Archetype change;
+                EdgeKind kind;
+                uint16_t target;
+                std::vector<ColumnCopy> copies;
+        };
+        struct ArchetypeChunks{
+                std::vector<uint16_t> chunks;
+                uint16_t full = 0;
+                ColumnLayout layout;
+                // The columns stored per row, from and to are the same offset.
+                std::vector<ColumnCopy> rows;
+                std::vector<ArchetypeEdge> edges;
         };
+        // Shared component values packed like a command payload of SHARED_ARCHETYPE.
+        struct SharedValues{
+                uint8_t bytes[sharedSize<Components...>() + 1];
+        };
+        // A snapshot is this header, the used part of the entity map, the free entity indexes in reuse order, the
+        // map slots and signatures of the archetypes, the indexes of the chunks and then the chunk images, each
+        // CHUNK_SIZE bytes and starting at chunks_offset, a multiple of CHUNK_ALIGNMENT.
+        struct SnapshotHeader{
+                uint32_t magic;
+                uint32_t version;
+                uint32_t max_entities;
+                uint32_t max_chunks;
+                uint32_t chunk_size;
+                uint32_t fingerprint;
+                uint32_t change_version;
+                uint32_t entities;
+                uint32_t free_entities;
+                uint32_t archetypes;
+                uint32_t chunks;
+                uint32_t reserved;
+                uint64_t chunks_offset;
+                uint64_t size;
+        };
+        static constexpr uint32_t SNAPSHOT_MAGIC = 0x53544f44;
+        static constexpr uint32_t SNAPSHOT_VERSION = 1;
 
         
-        EntityID newEntityID = 1;
         EntityID* entities_ids;
         EntityPosition* entities_positions;
+        uint32_t* free_entity_indexes;
+        uint32_t free_entities_front = 0;
+        uint32_t free_entities_size = 0;
+        uint32_t unused_entity_index = 0;
 
-        uint16_t newChunkIndex = 0;
-        std::bitset<MAP_CAPACITY_ARCHETYPES> full_chunks;
-        std::bitset<MAP_CAPACITY_ARCHETYPES> not_empty_chunks;
         Archetype archetypes[MAP_CAPACITY_ARCHETYPES];
-        uint16_t archetypes_chunks_indexes[MAP_CAPACITY_ARCHETYPES];
+        ArchetypeChunks archetypes_chunks[MAP_CAPACITY_ARCHETYPES];
+
+        Chunk** chunks;
+        std::vector<uint16_t> free_chunk_indexes;
+        std::vector<Chunk*> pooled_chunks;
+        unsigned compaction_cursor = 0;
+        // The last loaded snapshot, its chunks are used in place.
+        uint8_t* snapshot_memory = nullptr;
+        size_t snapshot_size = 0;
+
+        struct Query{
+                Archetype archetype;
+                std::vector<uint16_t> archetype_indexes;
+        };
+        std::deque<Query> queries;
+        std::mutex queries_lock;
+
+        std::atomic<uint32_t> change_version{1};
+
+        // The jobs scheduled through Views that last wrote each component and that read it since.
+        struct ComponentJobs{
+                JobHandle writer;
+                std::vector<JobHandle> readers;
+        };
+        ComponentJobs component_jobs[sizeof...(Components)];
+        // Held from collecting a View's dependencies until its jobs are registered, so Views scheduled from
+        // several threads see each other. JobSystem::schedule only queues, it never runs a job under this lock.
+        std::mutex component_jobs_lock;
+#ifdef DOTS_SAFETY_CHECKS
+        // The View job currently writing each component in the high half and how many of its batches run in the
+        // low half, plus how many jobs read it.
+        std::atomic<uint64_t> component_writers[sizeof...(Components)] = {};
+        std::atomic<uint32_t> component_readers[sizeof...(Components)] = {};
+        std::atomic<uint32_t> next_access_id{1};
+#endif
 
-        Chunk* chunks;
+        struct PendingEntity{
+                EntityID id;
+                Archetype archetype;
+                bool alive;
+                bool destroyed;
+                uint32_t first_write;
+                uint32_t last_write;
+        };
+        struct PendingWrite{
+                const uint8_t* data;
+                uint32_t next;
+                uint16_t component;
+        };
+        std::vector<PendingEntity> pending_entities;
+        std::vector<PendingWrite> pending_writes;
+        std::vector<uint32_t> pending_order;
+        std::unordered_map<EntityID, uint32_t> pending_indexes;
+
+        static constexpr uint32_t NO_PENDING_WRITE = std::numeric_limits<uint32_t>::max();
+
+        static constexpr unsigned payloadOffset(const Archetype archetype, const unsigned component){
+                unsigned offset = 0;
+                for(unsigned i = 0; i<component; ++i)
+                        if(archetype & componentBit(i)) offset += COMPONENT_SIZE[i];
+                return offset;
+        }
+
+        static constexpr Archetype componentBit(const unsigned i){
+                return SignatureTraits<Archetype>::bit(i);
+        }
 
         template<typename... Subset>
         struct getArchetype{
-                static constexpr Archetype value = 0;
+                static constexpr Archetype value = Archetype();
         };
         
         template<typename Component, typename... Subset>
         struct getArchetype<Component, Subset...>{
-                static constexpr Archetype value = (1<<getTypeIndex<Component, Components...>::value) | getArchetype<Subset...>::value;
+                static constexpr Archetype value = componentBit(getTypeIndex<Component, Components...>::value) | getArchetype<Subset...>::value;
         };
 
-        inline unsigned findEntityMapIndex(EntityID id){
-                unsigned i = id%MAP_CAPACITY_ENTITIES;
-                unsigned unvisiteds = MAP_CAPACITY_ENTITIES;
-                while (0<unvisiteds){
-                        if(entities_ids[i] == id)
-                                return i;
-                        if(entities_ids[i] == MAP_UNUSED_SPACE || entities_ids[i] == MAP_DIRTY_SPACE) 
-                                break;
-                        i = (i+1)%MAP_CAPACITY_ENTITIES;
-                        --unvisiteds;
-                }
-                throw std::runtime_error("Entity not found!");
-                return 0;
+        // The components of Subset a View may write, the ones not declared const, not shared and not tags.
+        template<typename... Subset>
+        struct getWriteArchetype{
+                static constexpr Archetype value = Archetype();
+        };
+
+        template<typename Component, typename... Subset>
+        struct getWriteArchetype<Component, Subset...>{
+                static constexpr Archetype value = (std::is_const<Component>::value || isSharedComponent<Component>::value || isTagComponent<Component>::value ? Archetype() : componentBit(getTypeIndex<std::remove_const_t<Component>, Components...>::value)) | getWriteArchetype<Subset...>::value;
+        };
+
+        static constexpr unsigned entityIndex(const EntityID id){
+                return id & ENTITY_INDEX_MASK;
         }
 
-        inline unsigned findAvailableEntityMapIndex(EntityID id){
-                unsigned i = id%MAP_CAPACITY_ENTITIES;
-                unsigned unvisiteds = MAP_CAPACITY_ENTITIES;
-                while (0<unvisiteds){
-                        if(entities_ids[i] == id || entities_ids[i] == MAP_UNUSED_SPACE)
-                                return i;
-                        if(entities_ids[i] == MAP_DIRTY_SPACE) 
-                                break;
-                        i = (i+1)%MAP_CAPACITY_ENTITIES;
-                        --unvisiteds;
-                }
-                if(unvisiteds == 0) throw std::runtime_error("Out of space!");
-                const unsigned first_dirty = i;
-                i = (i+1)%MAP_CAPACITY_ENTITIES;
-                --unvisiteds;
-                while (0<unvisiteds){
-                        if(entities_ids[i] == id)
-                                return i;
-                        if(entities_ids[i] == MAP_UNUSED_SPACE)
-                                break;
-                        i = (i+1)%MAP_CAPACITY_ENTITIES;
-                        --unvisiteds;
+        // Placeholders handed out by command buffers use generation 0, which live entities never have.
+        static constexpr bool isPlaceholder(const EntityID id){
+                return (id & ENTITY_GENERATION_MASK) == 0;
+        }
+
+        static constexpr EntityID nextGeneration(const EntityID id){
+                return isPlaceholder(id + ENTITY_GENERATION_ONE) ? (id & ENTITY_INDEX_MASK) + ENTITY_GENERATION_ONE : id + ENTITY_GENERATION_ONE;
+        }
+
+        inline unsigned findEntityIndex(const EntityID id) const {
+                const unsigned emi = entityIndex(id);
+                if(emi >= MAX_ENTITIES || entities_ids[emi] != id || isPlaceholder(id)) throw std::runtime_error("Entity not found!");
+                return emi;
+        }
+
+        // Freed indexes are reused in FIFO order and only once enough of them piled up, spreading generation
+        // bumps over many slots so stale ids take longer to wrap around to a live one.
+        inline unsigned allocateEntityIndex(){
+                if(free_entities_size > MIN_FREE_ENTITY_INDEXES || (unused_entity_index == MAX_ENTITIES && free_entities_size != 0)){
+                        const unsigned emi = free_entity_indexes[free_entities_front];
+                        free_entities_front = (free_entities_front + 1) % MAX_ENTITIES;
+                        --free_entities_size;
+                        DOTS_PROFILE_COUNT(ENTITIES_CREATED, 1);
+                        return emi;
                 }
-                return first_dirty;
+                if(unused_entity_index == MAX_ENTITIES) throw std::runtime_error("Out of space!");
+                DOTS_PROFILE_COUNT(ENTITIES_CREATED, 1);
+                entities_ids[unused_entity_index] = unused_entity_index + ENTITY_GENERATION_ONE;
+                return unused_entity_index++;
         }
 
-        inline void setupChunk(Archetype archetype, Chunk& chunk){
-                chunk.size = 0;
-                chunk.capacity = sizeof(uint16_t) + sizeof(EntityID);
+        inline void freeEntityIndex(const unsigned emi){
+                DOTS_PROFILE_COUNT(ENTITIES_DESTROYED, 1);
+                entities_ids[emi] = nextGeneration(entities_ids[emi]);
+                free_entity_indexes[(free_entities_front + free_entities_size) % MAX_ENTITIES] = emi;
+                ++free_entities_size;
+        }
+
+        static inline unsigned columnsSize(const Archetype archetype, const unsigned capacity){
+                unsigned sum = alignUp(capacity*sizeof(EntityID), COLUMN_ALIGNMENT);
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if(archetype & componentBit(i)) sum += alignUp(capacity*COLUMN_SIZE[i], COLUMN_ALIGNMENT);
+                return sum;
+        }
+
+        // Lays out the chunks of an archetype: the column versions and shared values first, then every column on a
+        // COLUMN_ALIGNMENT boundary. When rows are small enough the capacity is a multiple of COLUMN_ROWS_MULTIPLE
+        // so vector loops can run over whole blocks of rows. Tag columns point into the buffer but take no space.
+        static inline void setupColumnLayout(ColumnLayout& layout, const Archetype archetype){
+                unsigned row_size = sizeof(EntityID);
                 unsigned i;
+                layout.columns = 0;
+                for(i = 0; i<sizeof...(Components); ++i){
+                        layout.offset[i] = NO_COLUMN;
+                        if(archetype & componentBit(i)){
+                                layout.slot[i] = layout.columns++;
+                                row_size += COLUMN_SIZE[i];
+                        }
+                }
+                layout.versions = 0;
+                unsigned header_size = alignUp(layout.columns*sizeof(std::atomic<uint32_t>), SHARED_VALUE_ALIGNMENT);
                 for(i = 0; i<sizeof...(Components); ++i){
-                        if(archetype & (1<<i)){
-                                chunk.capacity += COMPONENT_SIZE[i];
+                        if(archetype & SHARED_ARCHETYPE & componentBit(i)){
+                                layout.offset[i] = header_size;
+                                header_size += alignUp(COMPONENT_SIZE[i], SHARED_VALUE_ALIGNMENT);
                         }
                 }
-                chunk.capacity = CHUNK_BUFFER_SIZE/chunk.capacity;
-                chunk.index = (uint16_t*)chunk.buffer;
-                chunk.id = (EntityID*)(chunk.buffer + chunk.capacity*sizeof(uint16_t));
-                unsigned sum = sizeof(uint16_t) + sizeof(EntityID);
+                header_size = alignUp(header_size, COLUMN_ALIGNMENT);
+                const unsigned buffer_size = header_size < CHUNK_BUFFER_SIZE ? CHUNK_BUFFER_SIZE - header_size : 0;
+                unsigned capacity = std::min<unsigned>(buffer_size/row_size, NO_CHUNK);
+                const unsigned step = COLUMN_ROWS_MULTIPLE <= capacity ? COLUMN_ROWS_MULTIPLE : 1;
+                capacity -= capacity%step;
+                while(capacity != 0 && buffer_size < columnsSize(archetype, capacity)) capacity -= step;
+                if(capacity == 0) throw std::runtime_error("Components don't fit in a chunk!");
+                layout.capacity = capacity;
+                layout.ids = header_size;
+                unsigned sum = header_size + alignUp(capacity*sizeof(EntityID), COLUMN_ALIGNMENT);
                 for(i = 0; i<sizeof...(Components); ++i){
-                        if(archetype & (1<<i)){
-                                chunk.component[i] = chunk.buffer + chunk.capacity*sum;
-                                sum += COMPONENT_SIZE[i];
-                        }else{
-                                chunk.component[i] = nullptr;
+                        if((archetype & componentBit(i)) && !(SHARED_ARCHETYPE & componentBit(i))){
+                                layout.offset[i] = sum;
+                                sum += alignUp(capacity*COLUMN_SIZE[i], COLUMN_ALIGNMENT);
                         }
                 }
         }
 
-        inline unsigned findAvailableArchetypeMapIndex(Archetype archetype){
-                unsigned i = archetype%MAP_CAPACITY_ARCHETYPES;
-                while(
-                        (archetypes[i] != archetype || full_chunks[i])
-                        && archetypes[i] != MAP_UNUSED_SPACE
-                ){i = (i+1)%MAP_CAPACITY_ARCHETYPES;}
-                return i;
+        inline void setupChunk(const unsigned ami, Chunk& chunk){
+                const ColumnLayout& layout = archetypes_chunks[ami].layout;
+                chunk.size = 0;
+                chunk.capacity = layout.capacity;
+                chunk.archetype_index = ami;
+                chunk.layout = &layout;
+                chunk.id = (EntityID*)(chunk.buffer + layout.ids);
+                chunk.versions = (std::atomic<uint32_t>*)(chunk.buffer + layout.versions);
+                const uint32_t version = change_version.load(std::memory_order_relaxed);
+                for(unsigned c = 0; c<layout.columns; ++c) new (chunk.versions + c) std::atomic<uint32_t>(version);
+        }
+
+        inline void readSharedValues(const Chunk& chunk, SharedValues& values) const {
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if((SHARED_ARCHETYPE & componentBit(i)) && chunk.component(i) != nullptr)
+                                std::memcpy(values.bytes + payloadOffset(SHARED_ARCHETYPE, i), chunk.component(i), COMPONENT_SIZE[i]);
+        }
+
+        inline bool hasSharedValues(const Chunk& chunk, const SharedValues& values) const {
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if((SHARED_ARCHETYPE & componentBit(i)) && chunk.component(i) != nullptr)
+                                if(std::memcmp(values.bytes + payloadOffset(SHARED_ARCHETYPE, i), chunk.component(i), COMPONENT_SIZE[i]) != 0) return false;
+                return true;
         }
 
         template<typename NewComponent, typename... NewComponents>
-        inline void insertComponentsToChunk(Chunk& chunk, const NewComponent& component, const NewComponents&... components){
-                std::memcpy(chunk.component[getTypeIndex<NewComponent, Components...>::value] + chunk.size*sizeof(NewComponent), &component, sizeof(NewComponent));
-                insertComponentsToChunk(chunk, components...);
+        static inline void writeSharedValues(SharedValues& values, const NewComponent& component, const NewComponents&... components){
+                if(isSharedComponent<NewComponent>::value)
+                        std::memcpy(values.bytes + payloadOffset(SHARED_ARCHETYPE, getTypeIndex<NewComponent, Components...>::value), &component, sizeof(NewComponent));
+                writeSharedValues(values, components...);
         }
 
-        inline void insertComponentsToChunk(Chunk& chunk){
+        static inline void writeSharedValues(SharedValues& values){
 
         }
 
-        template<typename... NewComponents>
-        inline void addEntityToArchetypeChunk(const EntityID id, const unsigned emi, const Archetype archetype, const NewComponents&... components){
-                entities_ids[emi] = id;
-                const unsigned ami = findAvailableArchetypeMapIndex(archetype);
-                if(archetypes[ami] == MAP_UNUSED_SPACE){
-                        archetypes[ami] = archetype;
-                        archetypes_chunks_indexes[ami] = newChunkIndex++;
-                        setupChunk(archetype, chunks[archetypes_chunks_indexes[ami]]);
-                }
-                Chunk& chunk = chunks[archetypes_chunks_indexes[ami]];
-                chunk.index[chunk.size] = emi;
-                chunk.id[chunk.size] = id;
-                insertComponentsToChunk(chunk, components...);
-                entities_positions[emi].archetype_index = ami;
-                entities_positions[emi].chunk_row = chunk.size;
-                chunk.size += 1;
-                if(chunk.size == 1) not_empty_chunks.set(ami);
-                else if(chunk.size == chunk.capacity) full_chunks.set(ami);
+        inline void setupArchetype(const unsigned ami, const Archetype archetype){
+                ArchetypeChunks& list = archetypes_chunks[ami];
+                setupColumnLayout(list.layout, archetype);
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if(list.layout.offset[i] != NO_COLUMN && COLUMN_SIZE[i] != 0)
+                                list.rows.push_back(ColumnCopy{list.layout.offset[i], list.layout.offset[i], COLUMN_SIZE[i]});
+                archetypes[ami] = archetype;
+                for(Query& query : queries)
+                        if(SignatureTraits<Archetype>::contains(archetype, query.archetype))
+                                query.archetype_indexes.push_back(ami);
         }
 
-        template<typename... NewComponents>
-        inline void transferEntityToArchetypeChunk(const unsigned emi, const Archetype archetype, const NewComponents&... components){
-                const unsigned ami = findAvailableArchetypeMapIndex(archetype);
-                if(archetypes[ami] == MAP_UNUSED_SPACE){
-                        archetypes[ami] = archetype;
-                        archetypes_chunks_indexes[ami] = newChunkIndex++;
-                        setupChunk(archetype, chunks[archetypes_chunks_indexes[ami]]);
-                }
-                Chunk& new_chunk = chunks[archetypes_chunks_indexes[ami]];
-                Chunk& old_chunk = chunks[archetypes_chunks_indexes[entities_positions[emi].archetype_index]];
-                const unsigned new_row = new_chunk.size;
-                const unsigned old_row = entities_positions[emi].chunk_row;
-                const unsigned old_last = old_chunk.size - 1;
-                new_chunk.index[new_row] = old_chunk.index[old_row];
-                old_chunk.index[old_row] = old_chunk.index[old_last];
-                new_chunk.id[new_row] = old_chunk.id[old_row];
-                old_chunk.id[old_row] = old_chunk.id[old_last];
-                for(unsigned i = 0; i<sizeof...(Components); ++i){
-                        if(old_chunk.component[i] != nullptr){
-                                if(new_chunk.component[i] != nullptr) std::memcpy(new_chunk.component[i] + new_row*COMPONENT_SIZE[i], old_chunk.component[i] + old_row*COMPONENT_SIZE[i], COMPONENT_SIZE[i]);
-                                std::memcpy(old_chunk.component[i] + old_row*COMPONENT_SIZE[i], old_chunk.component[i] + old_last*COMPONENT_SIZE[i], COMPONENT_SIZE[i]);
-                        }
-                }
-                insertComponentsToChunk(new_chunk, components...);
-                new_chunk.size += 1;
-                old_chunk.size -= 1;
-                if(new_chunk.size == new_chunk.capacity) full_chunks.set(ami);
-                if(old_chunk.size == 0) not_empty_chunks.set(entities_positions[emi].archetype_index, false);
-                entities_positions[old_chunk.index[old_row]].chunk_row = old_row;
-                entities_positions[emi].chunk_row = new_row;
-                entities_positions[emi].archetype_index = ami;
+        // Queries live in a deque so the index lists handed to iterators stay put when new queries are added.
+        inline const std::vector<uint16_t>* findQuery(const Archetype archetype){
+                std::lock_guard<std::mutex> lg(queries_lock);
+                for(const Query& query : queries)
+                        if(query.archetype == archetype)
+                                return &query.archetype_indexes;
+                queries.push_back(Query{archetype, {}});
+                Query& query = queries.back();
+                for(unsigned i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i)
+                        if(archetypes[i] != MAP_UNUSED_SPACE && SignatureTraits<Archetype>::contains(archetypes[i], archetype))
+                                query.archetype_indexes.push_back(i);
+                return &query.archetype_indexes;
         }
 
-        inline void removeEntityFromArchetypeChunk(const unsigned emi){
-                entities_ids[emi] = MAP_DIRTY_SPACE;
-                const unsigned ami = entities_positions[emi].archetype_index;
-                Chunk& chunk = chunks[archetypes_chunks_indexes[ami]];
-                const unsigned row = entities_positions[emi].chunk_row;
-                const unsigned last_row = --chunk.size;
-                if(row == last_row){
-                        if(chunk.size == 0) not_empty_chunks.set(ami, false);
-                        return;
-                }
-                entities_positions[chunk.index[last_row]].chunk_row = row;
-                chunk.index[row] = chunk.index[last_row];
-                chunk.id[row] = chunk.id[last_row];
-                for(unsigned i = 0; i<sizeof...(Components); ++i){
-                        if(chunk.component[i] != nullptr){
-                                std::memcpy(chunk.component[i] + row*COMPONENT_SIZE[i], chunk.component[i] + last_row*COMPONENT_SIZE[i], COMPONENT_SIZE[i]);
+        inline unsigned findArchetypeMapIndex(const Archetype archetype){
+                unsigned i = SignatureTraits<Archetype>::hash(archetype)%MAP_CAPACITY_ARCHETYPES;
+                for(unsigned unvisiteds = MAP_CAPACITY_ARCHETYPES; 0<unvisiteds; --unvisiteds){
+                        if(archetypes[i] == archetype) return i;
+                        if(archetypes[i] == MAP_UNUSED_SPACE){
+                                setupArchetype(i, archetype);
+                                return i;
                         }
+                        i = (i+1)%MAP_CAPACITY_ARCHETYPES;
                 }
+                throw std::runtime_error("Out of archetypes!");
+                return 0;
         }
-        
-        public:
-        template<typename... Subset>
-        class View{
-                static constexpr Archetype archetype = getArchetype<std::decay_t<Subset>...>::value;
-                Entities* entities;
 
-                public:
-                class SubView{
-                        Chunk* chunk;
+        inline Archetype entityArchetype(const unsigned emi) const {
+                return archetypes[chunks[entities_positions[emi].chunk]->archetype_index];
+        }
 
-                        public:
-                        SubView(Chunk* _chunk):chunk{_chunk}{}
-                        ~SubView(){}
-                        template<typename Component, std::enable_if_t<isTypePresent<Component, Subset...>::value, bool> = true>
-                        inline Component* write() const {
-                                return (Component*) chunk->component[getTypeIndex<Component, Components...>::value];
-                        }
-                        template<typename Component, std::enable_if_t<isTypePresent<Component, Subset...>::value, bool> = true>
-                        inline const Component* read() const {
-                                return (Component*) chunk->component[getTypeIndex<Component, Components...>::value];
-                        }
-                        inline const EntityID* readId() const {
-                                return chunk->id;
-                        }
-                        inline unsigned size() const {
-                                return chunk->size;
-                        }
+        // Chunk memory is page aligned and recycled through a small pool, anything beyond that is returned.
+        inline Chunk* allocateChunkMemory(){
+                if(pooled_chunks.empty()) return new (::operator new(CHUNK_SIZE, std::align_val_t(CHUNK_ALIGNMENT))) Chunk;
+                Chunk* chunk = pooled_chunks.back();
+                pooled_chunks.pop_back();
+                return chunk;
+        }
 
-                };
-                class iterator{
-                        unsigned i;
-                        Entities* entities;
+        inline void releaseChunkMemory(Chunk* chunk){
+                if(pooled_chunks.size() < CHUNK_POOL_CACHE) pooled_chunks.push_back(chunk);
+                else deleteChunkMemory(chunk);
+        }
 
-                        public:
-                        iterator(Entities* _entities): entities{_entities}{
-                                for(i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i)
-                                        if(((archetype & entities->archetypes[i]) == archetype) && entities->not_empty_chunks[i])
-                                                break;
-                        }
-                        iterator(): i{MAP_CAPACITY_ARCHETYPES}, entities{nullptr}{}
-                        ~iterator(){}
-                        bool operator!=(const iterator& other) const {return i != other.i;}
-                        iterator operator++(){
-                                for(++i; i<MAP_CAPACITY_ARCHETYPES; ++i)
-                                        if(((archetype & entities->archetypes[i]) == archetype) && entities->not_empty_chunks[i])
-                                                break;
-                                return *this;
-                        }
-                        SubView operator*() const {
-                                return SubView(entities->chunks + entities->archetypes_chunks_indexes[i]);
-                        }
-                };
-                View(Entities* _entities):entities{_entities}{}
-                ~View(){}
-                iterator begin() const {return iterator(entities);}
-                iterator end() const {return iterator();}
-        };
+        // Chunks of a loaded snapshot stay in its memory until the next load or the destructor.
+        inline void deleteChunkMemory(Chunk* chunk){
+                if(!isSnapshotChunk(chunk)) ::operator delete(chunk, std::align_val_t(CHUNK_ALIGNMENT));
+        }
 
-        Entities(){
-                entities_ids = new EntityID[MAP_CAPACITY_ENTITIES];
-                entities_positions = new EntityPosition[MAP_CAPACITY_ENTITIES];
-                chunks = new Chunk[MAX_CHUNKS];
+        inline bool isSnapshotChunk(const Chunk* chunk) const {
+                const uintptr_t address = (uintptr_t)chunk;
+                return (uintptr_t)snapshot_memory <= address && address < (uintptr_t)snapshot_memory + snapshot_size;
+        }
 
-                uint32_t i;
-                for(i = 0; i<MAP_CAPACITY_ENTITIES; ++i) entities_ids[i] = MAP_UNUSED_SPACE;
-                for(i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i) archetypes[i] = MAP_UNUSED_SPACE;
+        inline void swapArchetypeChunks(ArchetypeChunks& list, const unsigned a, const unsigned b){
+                std::swap(list.chunks[a], list.chunks[b]);
+                chunks[list.chunks[a]]->list_index = a;
+                chunks[list.chunks[b]]->list_index = b;
         }
-        ~Entities(){
-                delete[] entities_ids;
-                delete[] entities_positions;
-                delete[] chunks;
+
+        inline const ArchetypeEdge& addEdge(const unsigned ami, const unsigned target, const Archetype change, const EdgeKind kind){
+                std::vector<ColumnCopy> copies;
+                if(target != NO_TARGET){
+                        const ColumnLayout& from = archetypes_chunks[ami].layout;
+                        const ColumnLayout& to = archetypes_chunks[target].layout;
+                        for(unsigned i = 0; i<sizeof...(Components); ++i)
+                                if(from.offset[i] != NO_COLUMN && to.offset[i] != NO_COLUMN && COLUMN_SIZE[i] != 0)
+                                        copies.push_back(ColumnCopy{from.offset[i], to.offset[i], COLUMN_SIZE[i]});
+                }
+                archetypes_chunks[ami].edges.push_back(ArchetypeEdge{change, kind, (uint16_t)target, std::move(copies)});
+                return archetypes_chunks[ami].edges.back();
         }
-        inline EntityID createEntity(){
-                return newEntityID++;
+
+        // The step from the archetype in ami that adds or removes the components of change.
+        inline const ArchetypeEdge& findEdge(const unsigned ami, const Archetype change, const EdgeKind kind){
+                for(const ArchetypeEdge& edge : archetypes_chunks[ami].edges)
+                        if(edge.kind == kind && edge.change == change) return edge;
+                const Archetype target = kind == EDGE_ADD ? archetypes[ami] | change : archetypes[ami] & ~change;
+                return addEdge(ami, target == Archetype() ? NO_TARGET : findArchetypeMapIndex(target), change, kind);
         }
-        void destroyEntity(const EntityID id){
-                removeEntityFromArchetypeChunk(findEntityMapIndex(id));
+
+        // Any step from the archetype in ami to the one in target, used when the target is already known.
+        inline const ArchetypeEdge& findTransition(const unsigned ami, const unsigned target){
+                for(const ArchetypeEdge& edge : archetypes_chunks[ami].edges)
+                        if(edge.target == target) return edge;
+                return addEdge(ami, target, archetypes[target], EDGE_MOVE);
         }
-        template<typename... NewComponents>
-        void addComponents(const EntityID id, const NewComponents&... components){
-                constexpr Archetype addition_archetype = getArchetype<NewComponents...>::value;
-                const unsigned emi = findAvailableEntityMapIndex(id);
-                if(entities_ids[emi] == MAP_UNUSED_SPACE || entities_ids[emi] == MAP_DIRTY_SPACE){
-                        addEntityToArchetypeChunk(id, emi, addition_archetype, components...);
+
+        // Returns a chunk of the archetype with room for at least one more entity. Archetypes with shared
+        // components need the values the chunk must hold.
+        inline unsigned findArchetypeChunk(const Archetype archetype, const SharedValues* values = nullptr){
+                return findArchetypeChunkAt(findArchetypeMapIndex(archetype), values);
+        }
+
+        inline unsigned findArchetypeChunkAt(const unsigned ami, const SharedValues* values = nullptr){
+                const Archetype archetype = archetypes[ami];
+                ArchetypeChunks& list = archetypes_chunks[ami];
+                if(!(archetype & SHARED_ARCHETYPE)){
+                        if(list.full < list.chunks.size()) return list.chunks[list.full];
                 }else{
-                        const Archetype current_archetype = archetypes[entities_positions[emi].archetype_index];
-                        transferEntityToArchetypeChunk(emi, addition_archetype | current_archetype, components...);
+                        for(unsigned c = list.full; c<list.chunks.size(); ++c)
+                                if(hasSharedValues(*chunks[list.chunks[c]], *values)) return list.chunks[c];
                 }
+                if(free_chunk_indexes.empty()) throw std::runtime_error("Out of chunks!");
+                const unsigned ci = free_chunk_indexes.back();
+                free_chunk_indexes.pop_back();
+                Chunk* chunk = chunks[ci] = allocateChunkMemory();
+                setupChunk(ami, *chunk);
+                DOTS_PROFILE_COUNT(CHUNKS_ALLOCATED, 1);
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if(archetype & SHARED_ARCHETYPE & componentBit(i))
+                                std::memcpy(chunk->component(i), values->bytes + payloadOffset(SHARED_ARCHETYPE, i), COMPONENT_SIZE[i]);
+                chunk->list_index = list.chunks.size();
+                list.chunks.push_back(ci);
+                return ci;
         }
-         template<typename... OldComponents>
-        void delComponents(const EntityID id){
-                constexpr Archetype subtraction_archetype = getArchetype<OldComponents...>::value;
-                const unsigned emi = findEntityMapIndex(id);
-                const Archetype current_archetype = archetypes[entities_positions[emi].archetype_index];
-                const Archetype new_archetype = (subtraction_archetype ^ current_archetype) & current_archetype;
-                if(new_archetype != 0) transferEntityToArchetypeChunk(emi, new_archetype);
-                else removeEntityFromArchetypeChunk(emi);
+
+        // Keeps the archetype's chunk list partitioned after the chunk's size changed from old_size, and
+        // gives the chunk back once it is empty.
+        inline void chunkResized(const unsigned ci, const unsigned old_size){
+                Chunk& chunk = *chunks[ci];
+                ArchetypeChunks& list = archetypes_chunks[chunk.archetype_index];
+                if(chunk.size == chunk.capacity && old_size != chunk.capacity) swapArchetypeChunks(list, chunk.list_index, list.full++);
+                else if(chunk.size != chunk.capacity && old_size == chunk.capacity) swapArchetypeChunks(list, chunk.list_index, --list.full);
+                if(chunk.size != 0) return;
+                swapArchetypeChunks(list, chunk.list_index, list.chunks.size() - 1);
+                list.chunks.pop_back();
+                releaseChunkMemory(&chunk);
+                DOTS_PROFILE_COUNT(CHUNKS_RELEASED, 1);
+                chunks[ci] = nullptr;
+                free_chunk_indexes.push_back(ci);
         }
-        template<typename... Subset>
-        inline View<Subset...> select() {
-                return View<Subset...>(this);
+
+        inline PendingEntity& pendingEntity(const EntityID id){
+                auto found = pending_indexes.find(id);
+                if(found != pending_indexes.end()) return pending_entities[found->second];
+                pending_indexes.emplace(id, (uint32_t)pending_entities.size());
+                const bool alive = isAlive(id);
+                const Archetype archetype = (alive && entities_positions[entityIndex(id)].chunk != NO_CHUNK) ? entityArchetype(entityIndex(id)) : Archetype();
+                pending_entities.push_back(PendingEntity{id, archetype, alive, !alive, NO_PENDING_WRITE, NO_PENDING_WRITE});
+                return pending_entities.back();
         }
-};
 
-template<unsigned JOBS_QUEUE_CAPACITY>
-class JobSystem{
-        std::function<void(void)> queue_jobs[JOBS_QUEUE_CAPACITY];
-        unsigned queue_front = 0;
-        unsigned queue_back = 0;
-        unsigned queue_size = 0;
-        std::mutex queue_lock;
-        std::condition_variable queue_not_full;
-        std::condition_variable queue_not_empty;
+        template<typename NewComponent, typename... NewComponents>
+        inline void insertComponentsToChunk(Chunk& chunk, const unsigned row, const NewComponent& component, const NewComponents&... components){
+                constexpr unsigned size = COLUMN_SIZE[getTypeIndex<NewComponent, Components...>::value];
+                std::memcpy(chunk.component(getTypeIndex<NewComponent, Components...>::value) + row*size, &component, size);
+                insertComponentsToChunk(chunk, row, components...);
+        }
 
-        unsigned nworkers;
-        unsigned syncpoint_counter;
-        std::mutex syncpoint_lock;
-        std::condition_variable syncpoint_cv_1;
-        std::condition_variable syncpoint_cv_2;
-
-        const std::function<void(void)> SyncPointWait = [this]{
-                std::unique_lock<std::mutex> ul(syncpoint_lock);
-                syncpoint_cv_1.wait(ul, [this]{return syncpoint_counter < nworkers;});
-                syncpoint_counter -= 1;
-                ul.unlock();
-                syncpoint_cv_2.notify_one();
-        };
-        const std::function<void(void)> SyncPointWake = [this]{
-                {
-                        std::lock_guard<std::mutex> lg(syncpoint_lock);
-                        syncpoint_counter -= 1;
-                }
-                syncpoint_cv_1.notify_all();
+        inline void insertComponentsToChunk(Chunk& chunk, const unsigned row){
 
-                std::unique_lock<std::mutex> ul(syncpoint_lock);
-                syncpoint_cv_2.wait(ul, [this]{return syncpoint_counter == 1;});
-                syncpoint_counter = nworkers;
-        };
-        public:
-        inline void schedule(const std::function<void(void)>& job){
-                std::unique_lock<std::mutex> ul(queue_lock);
-                queue_not_full.wait(ul, [this](){return queue_size != JOBS_QUEUE_CAPACITY;});
-                queue_jobs[queue_back] = job;
-                queue_back = (queue_back + 1) % JOBS_QUEUE_CAPACITY;
-                ++queue_size;
-                ul.unlock();
-                queue_not_empty.notify_one();
         }
-        inline void scheduleSyncPoint(){
-                for(unsigned i = 1; i<nworkers; ++i)
-                        schedule(SyncPointWait);
-                schedule(SyncPointWake);
+
+        // Versions are compared by their difference so they keep working after wrapping around.
+        static inline bool isVersionNewer(const uint32_t version, const uint32_t since){
+                return (int32_t)(version - since) >= 0;
         }
-        inline void scheduleNotConcurrent(const std::function<void(void)>& job){
-                for(unsigned i = 1; i<nworkers; ++i)
-                        schedule(SyncPointWait);
-                schedule(job);
-                schedule(SyncPointWake);
+
+        static inline void markVersion(std::atomic<uint32_t>& column_version, const uint32_t version){
+                if(column_version.load(std::memory_order_relaxed) != version) column_version.store(version, std::memory_order_relaxed);
+        }
+
+        static inline void markColumnChanged(Chunk& chunk, const unsigned i, const uint32_t version){
+                markVersion(chunk.version(i), version);
+        }
+
+        inline void markChanged(Chunk& chunk){
+                const uint32_t version = change_version.load(std::memory_order_relaxed);
+                for(unsigned c = 0; c<chunk.layout->columns; ++c) markVersion(chunk.versions[c], version);
+        }
+
+        inline void markChanged(Chunk& chunk, const Archetype columns){
+                const uint32_t version = change_version.load(std::memory_order_relaxed);
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if((columns & componentBit(i)) && chunk.component(i) != nullptr) markColumnChanged(chunk, i, version);
+        }
+
+        template<typename... NewComponents>
+        inline void addEntityToArchetypeChunk(const unsigned emi, const unsigned ci, const NewComponents&... components){
+                Chunk& chunk = *chunks[ci];
+                chunk.id[chunk.size] = entities_ids[emi];
+                insertComponentsToChunk(chunk, chunk.size, components...);
+                markChanged(chunk);
+                entities_positions[emi].chunk = ci;
+                entities_positions[emi].chunk_row = chunk.size;
+                chunk.size += 1;
+                chunkResized(ci, chunk.size - 1);
+        }
+
+        // Moves the entity into chunk ci following the copy plan of the edge between both archetypes.
+        template<typename... NewComponents>
+        inline void transferEntityToArchetypeChunk(const unsigned emi, const unsigned ci, const std::vector<ColumnCopy>& copies, const NewComponents&... components){
+                DOTS_PROFILE_COUNT(ENTITIES_TRANSFERRED, 1);
+                const unsigned old_ci = entities_positions[emi].chunk;
+                Chunk& new_chunk = *chunks[ci];
+                Chunk& old_chunk = *chunks[old_ci];
+                const unsigned new_row = new_chunk.size;
+                const unsigned old_row = entities_positions[emi].chunk_row;
+                const unsigned old_last = old_chunk.size - 1;
+                new_chunk.id[new_row] = old_chunk.id[old_row];
+                old_chunk.id[old_row] = old_chunk.id[old_last];
+                for(const ColumnCopy& copy : copies)
+                        std::memcpy(new_chunk.buffer + copy.to + new_row*copy.size, old_chunk.buffer + copy.from + old_row*copy.size, copy.size);
+                if(old_row != old_last)
+                        for(const ColumnCopy& row : archetypes_chunks[old_chunk.archetype_index].rows)
+                                std::memcpy(old_chunk.buffer + row.from + old_row*row.size, old_chunk.buffer + row.from + old_last*row.size, row.size);
+                insertComponentsToChunk(new_chunk, new_row, components...);
+                markChanged(new_chunk);
+                if(old_row != old_last) markChanged(old_chunk);
+                new_chunk.size += 1;
+                old_chunk.size -= 1;
+                entities_positions[entityIndex(old_chunk.id[old_row])].chunk_row = old_row;
+                entities_positions[emi].chunk_row = new_row;
+                entities_positions[emi].chunk = ci;
+                chunkResized(ci, new_chunk.size - 1);
+                chunkResized(old_ci, old_chunk.size + 1);
+        }
+
+        // Fills the archetype chunks a whole free block at a time, writer(chunk, row, first, count) then fills
+        // the component columns of rows [row, row+count) with the values of entities [first, first+count).
+        template<typename Writer>
+        inline void createEntitiesInArchetype(const unsigned count, EntityID* ids, const Archetype archetype, const Writer& writer){
+                for(unsigned created = 0; created<count;){
+                        const unsigned ci = findArchetypeChunk(archetype);
+                        Chunk& chunk = *chunks[ci];
+                        const unsigned row = chunk.size;
+                        const unsigned n = std::min(count - created, (unsigned)(chunk.capacity - chunk.size));
+                        for(unsigned i = 0; i<n; ++i){
+                                const unsigned emi = allocateEntityIndex();
+                                entities_positions[emi].chunk = ci;
+                                entities_positions[emi].chunk_row = row + i;
+                                chunk.id[row + i] = entities_ids[emi];
+                                if(ids != nullptr) ids[created + i] = entities_ids[emi];
+                        }
+                        writer(chunk, row, created, n);
+                        markChanged(chunk);
+                        chunk.size += n;
+                        chunkResized(ci, row);
+                        created += n;
+                }
+        }
+
+        template<typename NewComponent, typename... NewComponents>
+        static inline void copyComponentColumns(Chunk& chunk, const unsigned row, const unsigned first, const unsigned count, const NewComponent* component, const NewComponents*... components){
+                constexpr unsigned size = COLUMN_SIZE[getTypeIndex<NewComponent, Components...>::value];
+                std::memcpy(chunk.component(getTypeIndex<NewComponent, Components...>::value) + row*size, component + first, count*size);
+                copyComponentColumns(chunk, row, first, count, components...);
+        }
+
+        static inline void copyComponentColumns(Chunk& chunk, const unsigned row, const unsigned first, const unsigned count){
+
+        }
+
+        template<typename NewComponent>
+        static inline NewComponent& constructComponent(Chunk& chunk, const unsigned row){
+                return *new (chunk.component(getTypeIndex<NewComponent, Components...>::value) + row*COLUMN_SIZE[getTypeIndex<NewComponent, Components...>::value]) NewComponent();
+        }
+
+        inline void removeEntityFromArchetypeChunk(const unsigned emi){
+                const unsigned ci = entities_positions[emi].chunk;
+                entities_positions[emi].chunk = NO_CHUNK;
+                Chunk& chunk = *chunks[ci];
+                const unsigned row = entities_positions[emi].chunk_row;
+                const unsigned last_row = --chunk.size;
+                if(row != last_row){
+                        markChanged(chunk);
+                        entities_positions[entityIndex(chunk.id[last_row])].chunk_row = row;
+                        chunk.id[row] = chunk.id[last_row];
+                        for(const ColumnCopy& copy : archetypes_chunks[chunk.archetype_index].rows)
+                                std::memcpy(chunk.buffer + copy.from + row*copy.size, chunk.buffer + copy.from + last_row*copy.size, copy.size);
+                }
+                chunkResized(ci, chunk.size + 1);
+        }
+
+        // Moves the last count rows of chunk from_ci to the end of chunk to_ci, both of the same archetype.
+        inline void moveRowsBetweenChunks(const unsigned from_ci, const unsigned to_ci, const unsigned count){
+                Chunk& from = *chunks[from_ci];
+                Chunk& to = *chunks[to_ci];
+                const unsigned from_row = from.size - count;
+                const unsigned to_row = to.size;
+                std::memcpy(to.id + to_row, from.id + from_row, count*sizeof(EntityID));
+                for(const ColumnCopy& copy : archetypes_chunks[to.archetype_index].rows)
+                        std::memcpy(to.buffer + copy.to + to_row*copy.size, from.buffer + copy.from + from_row*copy.size, count*copy.size);
+                for(unsigned i = 0; i<count; ++i){
+                        EntityPosition& position = entities_positions[entityIndex(to.id[to_row + i])];
+                        position.chunk = to_ci;
+                        position.chunk_row = to_row + i;
+                }
+                markChanged(to);
+                from.size -= count;
+                to.size += count;
+                chunkResized(to_ci, to.size - count);
+                chunkResized(from_ci, from.size + count);
+        }
+
+        // Empties the sparsest non-full chunks of the archetype into the fullest ones holding the same shared
+        // values, moving at most budget rows. Returns the amount of chunks given back.
+        inline unsigned compactArchetype(const unsigned ami, unsigned& budget){
+                ArchetypeChunks& list = archetypes_chunks[ami];
+                if(list.chunks.size() - list.full < 2) return 0;
+                std::vector<uint16_t> candidates(list.chunks.begin() + list.full, list.chunks.end());
+                std::sort(candidates.begin(), candidates.end(), [this](const uint16_t a, const uint16_t b){
+                        return chunks[a]->size > chunks[b]->size;
+                });
+                unsigned released = 0;
+                std::vector<uint16_t> group;
+                SharedValues values{};
+                while(candidates.size() > 1 && budget != 0){
+                        group.clear();
+                        if(!(archetypes[ami] & SHARED_ARCHETYPE)) group.swap(candidates);
+                        else{
+                                readSharedValues(*chunks[candidates[0]], values);
+                                unsigned kept = 0;
+                                for(const uint16_t ci : candidates){
+                                        if(hasSharedValues(*chunks[ci], values)) group.push_back(ci);
+                                        else candidates[kept++] = ci;
+                                }
+                                candidates.resize(kept);
+                        }
+                        unsigned first = 0;
+                        unsigned last = group.size();
+                        while(first + 1 < last && budget != 0){
+                                const Chunk& to = *chunks[group[first]];
+                                const Chunk& from = *chunks[group[last - 1]];
+                                if(to.size == to.capacity){
+                                        ++first;
+                                        continue;
+                                }
+                                const unsigned count = std::min({(unsigned)from.size, (unsigned)(to.capacity - to.size), budget});
+                                const bool emptied = count == from.size;
+                                moveRowsBetweenChunks(group[last - 1], group[first], count);
+                                budget -= count;
+                                if(emptied){
+                                        --last;
+                                        ++released;
+                                }
+                        }
+                }
+                return released;
+        }
+
+        // Hashes what the snapshot format depends on besides the template arguments, snapshots of the same
+        // Entities with differently sized components are told apart but not ones with equally sized ones.
+        static constexpr uint32_t snapshotFingerprint(){
+                uint32_t hash = 2166136261u;
+                for(unsigned i = 0; i<sizeof...(Components); ++i){
+                        hash = (hash ^ COMPONENT_SIZE[i])*16777619u;
+                        hash = (hash ^ COLUMN_SIZE[i])*16777619u;
+                }
+                hash = (hash ^ (uint32_t)sizeof...(Components))*16777619u;
+                hash = (hash ^ (uint32_t)sizeof(Archetype))*16777619u;
+                return (hash ^ (uint32_t)sizeof(ChunkHeader))*16777619u;
+        }
+
+        static inline size_t snapshotMetadataSize(const SnapshotHeader& header){
+                return sizeof(SnapshotHeader) + header.entities*(sizeof(EntityID) + sizeof(EntityPosition)) + header.free_entities*sizeof(uint32_t)
+                        + header.archetypes*(sizeof(uint16_t) + sizeof(Archetype)) + header.chunks*sizeof(uint16_t);
+        }
+
+        // Maps the file copy-on-write, or reads it into page aligned memory where mmap is not available.
+        static inline uint8_t* readSnapshotFile(const char* path, size_t& size){
+#ifndef _WIN32
+                const int file = ::open(path, O_RDONLY);
+                if(file < 0) throw std::runtime_error("Can't open snapshot!");
+                struct stat status;
+                if(::fstat(file, &status) != 0 || status.st_size < (off_t)sizeof(SnapshotHeader)){
+                        ::close(file);
+                        throw std::runtime_error("Invalid snapshot!");
+                }
+                size = status.st_size;
+                void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+                ::close(file);
+                if(memory == MAP_FAILED) throw std::runtime_error("Can't map snapshot!");
+                return (uint8_t*)memory;
+#else
+                FILE* file = std::fopen(path, "rb");
+                if(file == nullptr) throw std::runtime_error("Can't open snapshot!");
+                long length = -1;
+                if(std::fseek(file, 0, SEEK_END) == 0) length = std::ftell(file);
+                if(length < (long)sizeof(SnapshotHeader) || std::fseek(file, 0, SEEK_SET) != 0){
+                        std::fclose(file);
+                        throw std::runtime_error("Invalid snapshot!");
+                }
+                size = length;
+                uint8_t* memory = (uint8_t*)::operator new(size, std::align_val_t(CHUNK_ALIGNMENT));
+                const bool read = std::fread(memory, 1, size, file) == size;
+                std::fclose(file);
+                if(!read){
+                        ::operator delete(memory, std::align_val_t(CHUNK_ALIGNMENT));
+                        throw std::runtime_error("Can't read snapshot!");
+                }
+                return memory;
+#endif
+        }
+
+        static inline void freeSnapshotMemory(uint8_t* memory, const size_t size){
+#ifndef _WIN32
+                ::munmap(memory, size);
+#else
+                ::operator delete(memory, std::align_val_t(CHUNK_ALIGNMENT));
+#endif
+        }
+
+        // Checks the header and the tables, the entity map and the chunk contents are trusted.
+        static inline bool isValidSnapshot(const uint8_t* memory, const size_t size){
+                SnapshotHeader header;
+                std::memcpy(&header, memory, sizeof(header));
+                if(header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.max_entities != MAX_ENTITIES || header.max_chunks != MAX_CHUNKS
+                        || header.chunk_size != CHUNK_SIZE || header.fingerprint != snapshotFingerprint()) return false;
+                if(header.entities > MAX_ENTITIES || header.free_entities > header.entities || header.archetypes > MAP_CAPACITY_ARCHETYPES || header.chunks > MAX_CHUNKS) return false;
+                if(header.size != size || header.chunks_offset%CHUNK_ALIGNMENT != 0 || header.chunks_offset < snapshotMetadataSize(header)
+                        || header.chunks_offset + (uint64_t)header.chunks*CHUNK_SIZE != size) return false;
+                const uint8_t* slots = memory + sizeof(SnapshotHeader) + header.entities*(sizeof(EntityID) + sizeof(EntityPosition)) + header.free_entities*sizeof(uint32_t);
+                const uint8_t* indexes = slots + header.archetypes*(sizeof(uint16_t) + sizeof(Archetype));
+                std::vector<uint16_t> archetype_chunks(MAP_CAPACITY_ARCHETYPES, NO_CHUNK);
+                for(unsigned a = 0; a<header.archetypes; ++a){
+                        uint16_t slot;
+                        std::memcpy(&slot, slots + a*sizeof(uint16_t), sizeof(slot));
+                        if(slot >= MAP_CAPACITY_ARCHETYPES || archetype_chunks[slot] != NO_CHUNK) return false;
+                        archetype_chunks[slot] = 0;
+                }
+                for(unsigned c = 0; c<header.chunks; ++c){
+                        const ChunkHeader& chunk = *(const ChunkHeader*)(memory + header.chunks_offset + (size_t)c*CHUNK_SIZE);
+                        if(chunk.archetype_index >= MAP_CAPACITY_ARCHETYPES || archetype_chunks[chunk.archetype_index] == NO_CHUNK) return false;
+                        if(chunk.size == 0 || chunk.capacity < chunk.size) return false;
+                        ++archetype_chunks[chunk.archetype_index];
+                }
+                std::vector<bool> used(MAX_CHUNKS, false);
+                for(unsigned c = 0; c<header.chunks; ++c){
+                        uint16_t ci;
+                        std::memcpy(&ci, indexes + c*sizeof(uint16_t), sizeof(ci));
+                        const ChunkHeader& chunk = *(const ChunkHeader*)(memory + header.chunks_offset + (size_t)c*CHUNK_SIZE);
+                        if(ci >= MAX_CHUNKS || used[ci] || chunk.list_index >= archetype_chunks[chunk.archetype_index]) return false;
+                        used[ci] = true;
+                }
+                return true;
+        }
+        
+        // Collects the unfinished jobs a View reading reads and writing writes has to wait for: the last writer
+        // of everything it reads, and also the readers of everything it writes.
+        template<typename Jobs>
+        inline void accessDependencies(Jobs& jobs, const Archetype reads, const Archetype writes, std::vector<JobHandle>& dependencies){
+                for(unsigned i = 0; i<sizeof...(Components); ++i){
+                        if(!(reads & componentBit(i))) continue;
+                        const ComponentJobs& access = component_jobs[i];
+                        if(!jobs.isComplete(access.writer)) dependencies.push_back(access.writer);
+                        if(writes & componentBit(i))
+                                for(const JobHandle& reader : access.readers)
+                                        if(!jobs.isComplete(reader)) dependencies.push_back(reader);
+                }
+        }
+
+        template<typename Jobs>
+        inline void registerAccess(Jobs& jobs, const Archetype reads, const Archetype writes, const JobHandle& handle){
+                for(unsigned i = 0; i<sizeof...(Components); ++i){
+                        ComponentJobs& access = component_jobs[i];
+                        if(writes & componentBit(i)){
+                                access.writer = handle;
+                                access.readers.clear();
+                        }else if(reads & componentBit(i)){
+                                access.readers.erase(std::remove_if(access.readers.begin(), access.readers.end(), [&jobs](const JobHandle& reader){
+                                        return jobs.isComplete(reader);
+                                }), access.readers.end());
+                                access.readers.push_back(handle);
+                        }
+                }
+        }
+
+#ifdef DOTS_SAFETY_CHECKS
+        // Runs inside worker jobs where nothing would catch an exception, so it reports and aborts instead.
+        [[noreturn]] static inline void accessViolation(const char* message, const unsigned component){
+                std::fprintf(stderr, "DOTS safety check failed: %s (component %u)\n", message, component);
+                std::abort();
+        }
+
+        // Marks the components as used by the batches of View job id until endAccess, batches of the same job may
+        // write a component together but nothing else may touch what a job writes.
+        inline void beginAccess(const uint32_t id, const Archetype reads, const Archetype writes){
+                for(unsigned i = 0; i<sizeof...(Components); ++i){
+                        if(writes & componentBit(i)){
+                                uint64_t current = component_writers[i].load(std::memory_order_relaxed);
+                                do{
+                                        if(current != 0 && (current >> 32) != id) accessViolation("jobs write the same component concurrently", i);
+                                }while(!component_writers[i].compare_exchange_weak(current, current == 0 ? ((uint64_t)id << 32) + 1 : current + 1));
+                                if(component_readers[i].load() != 0) accessViolation("a job writes a component other jobs read", i);
+                        }else if(reads & componentBit(i)){
+                                component_readers[i].fetch_add(1);
+                                if(component_writers[i].load() != 0) accessViolation("a job reads a component another job writes", i);
+                        }
+                }
+        }
+
+        inline void endAccess(const Archetype reads, const Archetype writes){
+                for(unsigned i = 0; i<sizeof...(Components); ++i){
+                        if(writes & componentBit(i)){
+                                uint64_t current = component_writers[i].load(std::memory_order_relaxed);
+                                while(!component_writers[i].compare_exchange_weak(current, (current & 0xffffffffu) == 1 ? 0 : current - 1));
+                        }else if(reads & componentBit(i)) component_readers[i].fetch_sub(1);
+                }
+        }
+#endif
+
+        inline void checkStructuralChange() const {
+#ifdef DOTS_SAFETY_CHECKS
+                for(unsigned i = 0; i<sizeof...(Components); ++i)
+                        if(component_writers[i].load() != 0 || component_readers[i].load() != 0) throw std::runtime_error("Structural change while jobs access components!");
+#endif
+        }
+
+        public:
+        template<typename... Subset>
+        // Components listed const in Subset are only read, the View's jobs are ordered after the jobs writing
+        // what they read and, for what they write, also after the jobs reading it.
+        class View{
+                static constexpr Archetype archetype = getArchetype<std::decay_t<Subset>...>::value;
+                static constexpr Archetype write_archetype = getWriteArchetype<Subset...>::value;
+
+                template<typename Component>
+                struct isReadable{
+                        static constexpr bool value = isTypePresent<std::remove_const_t<Component>, std::remove_const_t<Subset>...>::value;
+                };
+
+                template<typename Component>
+                struct isWritable{
+                        static constexpr bool value = isTypePresent<Component, Subset...>::value && !std::is_const<Component>::value && !isSharedComponent<Component>::value && !isTagComponent<Component>::value;
+                };
+
+                Entities* entities;
+                const std::vector<uint16_t>* archetype_indexes;
+                bool only_changed = false;
+                uint32_t changed_since = 0;
+                Archetype shared_filter{};
+                SharedValues shared_values{};
+
+                public:
+                class SubView{
+                        Chunk* chunk;
+                        uint16_t first;
+                        uint16_t last;
+                        uint32_t version;
+                        friend class View;
+
+                        // Columns of the components Subset lists as const can only be read. Tags have no data to write,
+                        // listed non-const they are handed out without counting as a write.
+                        template<typename Component>
+                        inline std::enable_if_t<std::is_const<Component>::value || isTagComponent<Component>::value, Component*> column() const {
+                                return const_cast<Component*>(read<std::remove_const_t<Component>>());
+                        }
+                        template<typename Component>
+                        inline std::enable_if_t<!std::is_const<Component>::value && !isTagComponent<Component>::value, Component*> column() const {
+                                return write<Component>();
+                        }
+
+                        public:
+                        SubView(Chunk* _chunk, uint32_t _version):chunk{_chunk}, first{0}, last{_chunk->size}, version{_version}{}
+                        SubView(Chunk* _chunk, uint16_t _first, uint16_t _last, uint32_t _version):chunk{_chunk}, first{_first}, last{_last}, version{_version}{}
+                        ~SubView(){}
+                        // Taking a column for writing stamps it with the change version the View was iterated at.
+                        template<typename Component, std::enable_if_t<isWritable<Component>::value, bool> = true>
+                        inline Component* write() const {
+                                markColumnChanged(*chunk, getTypeIndex<Component, Components...>::value, version);
+                                return (Component*) chunk->component(getTypeIndex<Component, Components...>::value) + first;
+                        }
+                        template<typename Component, std::enable_if_t<isReadable<Component>::value, bool> = true>
+                        inline uint32_t changeVersion() const {
+                                return chunk->version(getTypeIndex<std::remove_const_t<Component>, Components...>::value).load(std::memory_order_relaxed);
+                        }
+                        template<typename Component, std::enable_if_t<isReadable<Component>::value && !isSharedComponent<Component>::value, bool> = true>
+                        inline const Component* read() const {
+                                return (const Component*) chunk->component(getTypeIndex<std::remove_const_t<Component>, Components...>::value) + first;
+                        }
+                        // The value every entity of the chunk shares.
+                        template<typename Component, std::enable_if_t<isReadable<Component>::value && isSharedComponent<Component>::value, bool> = true>
+                        inline const Component& shared() const {
+                                return *(const Component*) chunk->component(getTypeIndex<std::remove_const_t<Component>, Components...>::value);
+                        }
+                        inline const EntityID* readId() const {
+                                return chunk->id + first;
+                        }
+                        inline unsigned size() const {
+                                return last - first;
+                        }
+                        // write/read columns start COLUMN_ALIGNMENT aligned when sizeof(Component) is a multiple of 4
+                        // and stay valid for paddedSize() rows, a whole number of COLUMN_ROWS_MULTIPLE blocks at the end
+                        // of a chunk, so kernels can use aligned vector loads. Rows past size() hold garbage and may be overwritten.
+                        inline unsigned paddedSize() const {
+                                if(last != chunk->size) return last - first;
+                                return std::min<unsigned>(alignUp(last, COLUMN_ROWS_MULTIPLE), chunk->capacity) - first;
+                        }
+
+                };
+                // Walks every chunk of every matching archetype, i indexes the archetypes and c their chunks.
+                class iterator{
+                        unsigned i;
+                        unsigned c;
+                        const View* view;
+                        uint32_t version;
+
+                        inline Chunk* chunk() const {
+                                return view->entities->chunks[view->entities->archetypes_chunks[(*view->archetype_indexes)[i]].chunks[c]];
+                        }
+
+                        inline bool isSelected() const {
+                                for(unsigned index = 0; index<sizeof...(Components); ++index)
+                                        if((view->shared_filter & componentBit(index)) && std::memcmp(chunk()->component(index), view->shared_values.bytes + payloadOffset(SHARED_ARCHETYPE, index), COMPONENT_SIZE[index]) != 0) return false;
+                                return !view->only_changed || isChanged(chunk(), view->changed_since);
+                        }
+
+                        // Also skips the chunks the View filters out.
+                        inline void skipEmpty(){
+                                while(i<view->archetype_indexes->size()){
+                                        if(c == view->entities->archetypes_chunks[(*view->archetype_indexes)[i]].chunks.size()){
+                                                ++i;
+                                                c = 0;
+                                        }else if(!isSelected()) ++c;
+                                        else break;
+                                }
+                        }
+
+                        public:
+                        iterator(const View* _view): i{0}, c{0}, view{_view}, version{_view->entities->change_version.load(std::memory_order_relaxed)}{
+                                skipEmpty();
+                        }
+                        iterator(const View* _view, unsigned _i): i{_i}, c{0}, view{_view}, version{0}{}
+                        ~iterator(){}
+                        bool operator!=(const iterator& other) const {return i != other.i || c != other.c;}
+                        iterator operator++(){
+                                ++c;
+                                skipEmpty();
+                                return *this;
+                        }
+                        SubView operator*() const {
+                                return SubView(chunk(), version);
+                        }
+                };
+                View(Entities* _entities):entities{_entities}, archetype_indexes{_entities->findQuery(archetype)}{}
+                ~View(){}
+                iterator begin() const {return iterator(this);}
+                iterator end() const {return iterator(this, archetype_indexes->size());}
+
+                // The same View restricted to the chunks where a column of Subset was written at or after version,
+                // usually the Entities::nextChangeVersion() a system took after its last run. Scheduled after
+                // unfinished jobs the chunks are picked when the batches run, so they see what those jobs wrote.
+                inline View changedSince(const uint32_t version) const {
+                        View view = *this;
+                        view.only_changed = true;
+                        view.changed_since = version;
+                        return view;
+                }
+
+                // The same View restricted to the chunks whose shared Component equals value.
+                template<typename Component>
+                inline View withShared(const Component& value) const {
+                        static_assert(isReadable<Component>::value && isSharedComponent<Component>::value, "withShared needs a shared component of the View");
+                        View view = *this;
+                        view.shared_filter |= componentBit(getTypeIndex<Component, Components...>::value);
+                        writeSharedValues(view.shared_values, value);
+                        return view;
+                }
+
+                // Splits the matching chunks into batches of about batch_size entities, cutting large chunks
+                // into row ranges, and schedules one job per batch. batch_size 0 picks a size from the worker count.
+                // The batches start after dependency and after the jobs of earlier Views conflicting with this one.
+                template<typename Jobs, typename Function>
+                JobHandle parallelForChunks(Jobs& jobs, const Function& function, const JobHandle& dependency = JobHandle(), unsigned batch_size = 0) const {
+                        std::lock_guard<std::mutex> lg(entities->component_jobs_lock);
+                        std::vector<JobHandle> dependencies{dependency};
+                        entities->accessDependencies(jobs, archetype, write_archetype, dependencies);
+                        const JobHandle after = dependencies.size() == 1 ? dependency : jobs.combine(dependencies);
+                        // Versions written by the jobs still to run can't be known yet, the batches filter their ranges instead.
+                        const bool check_versions = only_changed && !jobs.isComplete(after);
+                        View selection = *this;
+                        selection.only_changed = only_changed && !check_versions;
+                        const uint32_t since = changed_since;
+                        std::vector<SubView> chunks;
+                        unsigned total = 0;
+                        for(auto subview : selection){
+                                chunks.push_back(subview);
+                                total += subview.size();
+                        }
+                        if(total == 0) return after;
+                        if(batch_size == 0) batch_size = std::max(PARALLEL_FOR_MIN_BATCH, total/(jobs.amountOfWorkers()*PARALLEL_FOR_BATCHES_PER_WORKER));
+
+                        auto ranges = std::make_shared<std::vector<SubView>>();
+                        std::vector<unsigned> batches{0};
+                        unsigned filled = 0;
+                        for(SubView chunk : chunks){
+                                while(filled + chunk.size() >= batch_size){
+                                        // Splits stay on COLUMN_ROWS_MULTIPLE boundaries so every range keeps its columns aligned.
+                                        const uint16_t split = std::min<unsigned>(alignUp(chunk.first + (batch_size - filled), COLUMN_ROWS_MULTIPLE), chunk.last);
+                                        ranges->push_back(SubView(chunk.chunk, chunk.first, split, chunk.version));
+                                        chunk.first = split;
+                                        batches.push_back(ranges->size());
+                                        filled = 0;
+                                }
+                                if(chunk.size() == 0) continue;
+                                ranges->push_back(chunk);
+                                filled += chunk.size();
+                        }
+                        if(filled != 0) batches.push_back(ranges->size());
+
+                        std::vector<JobHandle> handles;
+                        handles.reserve(batches.size() - 1);
+#ifdef DOTS_SAFETY_CHECKS
+                        Entities* owner = entities;
+                        const uint32_t id = entities->next_access_id.fetch_add(1, std::memory_order_relaxed);
+#endif
+                        for(unsigned b = 1; b<batches.size(); ++b){
+                                const unsigned first = batches[b - 1];
+                                const unsigned last = batches[b];
+#ifdef DOTS_SAFETY_CHECKS
+                                handles.push_back(jobs.schedule([ranges, first, last, function, owner, id, check_versions, since]{
+                                        owner->beginAccess(id, archetype, write_archetype);
+                                        for(unsigned i = first; i<last; ++i)
+                                                if(!check_versions || isChanged((*ranges)[i].chunk, since)) function((*ranges)[i]);
+                                        owner->endAccess(archetype, write_archetype);
+                                }, after));
+#else
+                                handles.push_back(jobs.schedule([ranges, first, last, function, check_versions, since]{
+                                        for(unsigned i = first; i<last; ++i)
+                                                if(!check_versions || isChanged((*ranges)[i].chunk, since)) function((*ranges)[i]);
+                                }, after));
+#endif
+                        }
+                        const JobHandle handle = jobs.combine(handles);
+                        entities->registerAccess(jobs, archetype, write_archetype, handle);
+                        return handle;
+                }
+
+                // Schedules function(view) as a single job ordered like parallelForChunks.
+                template<typename Jobs, typename Function>
+                JobHandle schedule(Jobs& jobs, const Function& function, const JobHandle& dependency = JobHandle()) const {
+                        std::lock_guard<std::mutex> lg(entities->component_jobs_lock);
+                        std::vector<JobHandle> dependencies{dependency};
+                        entities->accessDependencies(jobs, archetype, write_archetype, dependencies);
+                        const auto view = std::make_shared<View>(*this);
+#ifdef DOTS_SAFETY_CHECKS
+                        const uint32_t id = entities->next_access_id.fetch_add(1, std::memory_order_relaxed);
+                        const JobHandle handle = jobs.schedule([view, function, id]{
+                                view->entities->beginAccess(id, archetype, write_archetype);
+                                function(*view);
+                                view->entities->endAccess(archetype, write_archetype);
+                        }, dependencies);
+#else
+                        const JobHandle handle = jobs.schedule([view, function]{
+                                function(*view);
+                        }, dependencies);
+#endif
+                        entities->registerAccess(jobs, archetype, write_archetype, handle);
+                        return handle;
+                }
+
+                // Waits for the jobs conflicting with this View, after which the calling thread may iterate it.
+                template<typename Jobs>
+                void completeDependencies(Jobs& jobs) const {
+                        std::vector<JobHandle> dependencies;
+                        {
+                                std::lock_guard<std::mutex> lg(entities->component_jobs_lock);
+                                entities->accessDependencies(jobs, archetype, write_archetype, dependencies);
+                        }
+                        for(const JobHandle& dependency : dependencies) jobs.complete(dependency);
+                }
+
+                template<typename Jobs, typename Function>
+                JobHandle parallelForEach(Jobs& jobs, const Function& function, const JobHandle& dependency = JobHandle(), unsigned batch_size = 0) const {
+                        static_assert((archetype & SHARED_ARCHETYPE) == Archetype(), "Use parallelForChunks and SubView::shared for shared components");
+                        return parallelForChunks(jobs, [function](const SubView& subview){
+                                forEachRow(function, subview.size(), subview.template column<Subset>()...);
+                        }, dependency, batch_size);
+                }
+
+                private:
+                static constexpr unsigned SUBSET_INDEXES[] = {getTypeIndex<std::decay_t<Subset>, Components...>::value...};
+
+                static inline bool isChanged(const Chunk* chunk, const uint32_t since){
+                        for(const unsigned index : SUBSET_INDEXES)
+                                if(isVersionNewer(chunk->version(index).load(std::memory_order_relaxed), since)) return true;
+                        return false;
+                }
+
+                template<typename Function, typename... Columns>
+                static inline void forEachRow(const Function& function, const unsigned size, Columns*... columns){
+                        for(unsigned i = 0; i<size; ++i) function(columns[i]...);
+                }
+        };
+
+        // Records structural changes to be applied later by Entities::playback. Each thread should
+        // record into its own buffer. createEntity returns a placeholder that is only meaningful inside this buffer.
+        class CommandBuffer{
+                friend class Entities;
+                enum Command : uint8_t {CREATE, ADD, DEL, DESTROY};
+                struct Header{
+                        uint32_t size;
+                        EntityID id;
+                        Archetype archetype;
+                        Command command;
+                };
+
+                std::vector<uint8_t> arena;
+                EntityID placeholders = 0;
+
+                inline uint8_t* record(const Command command, const EntityID id, const Archetype archetype, const unsigned payload_size){
+                        const Header header{(uint32_t)(sizeof(Header) + payload_size), id, archetype, command};
+                        const size_t position = arena.size();
+                        arena.resize(position + header.size);
+                        std::memcpy(arena.data() + position, &header, sizeof(Header));
+                        return arena.data() + position + sizeof(Header);
+                }
+
+                template<typename NewComponent, typename... NewComponents>
+                static inline void writePayload(uint8_t* payload, const Archetype archetype, const NewComponent& component, const NewComponents&... components){
+                        std::memcpy(payload + payloadOffset(archetype, getTypeIndex<NewComponent, Components...>::value), &component, COMPONENT_SIZE[getTypeIndex<NewComponent, Components...>::value]);
+                        writePayload(payload, archetype, components...);
+                }
+
+                static inline void writePayload(uint8_t* payload, const Archetype archetype){
+
+                }
+
+                public:
+                inline EntityID createEntity(){
+                        const EntityID id = placeholders++;
+                        record(CREATE, id, Archetype(), 0);
+                        return id;
+                }
+                inline void destroyEntity(const EntityID id){
+                        record(DESTROY, id, Archetype(), 0);
+                }
+                template<typename... NewComponents>
+                inline void addComponents(const EntityID id, const NewComponents&... components){
+                        constexpr Archetype addition_archetype = getArchetype<NewComponents...>::value;
+                        uint8_t* payload = record(ADD, id, addition_archetype, payloadOffset(addition_archetype, sizeof...(Components)));
+                        writePayload(payload, addition_archetype, components...);
+                }
+                template<typename... OldComponents>
+                inline void delComponents(const EntityID id){
+                        record(DEL, id, getArchetype<OldComponents...>::value, 0);
+                }
+                inline bool empty() const {return arena.empty();}
+                inline void clear(){
+                        arena.clear();
+                        placeholders = 0;
+                }
+        };
+
+        Entities(){
+                entities_ids = new EntityID[MAX_ENTITIES];
+                entities_positions = new EntityPosition[MAX_ENTITIES];
+                free_entity_indexes = new uint32_t[MAX_ENTITIES];
+                chunks = new Chunk*[MAX_CHUNKS];
+
+                uint32_t i;
+                for(i = 0; i<MAX_ENTITIES; ++i) entities_ids[i] = 0;
+                for(i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i) archetypes[i] = MAP_UNUSED_SPACE;
+                for(i = 0; i<MAX_CHUNKS; ++i) chunks[i] = nullptr;
+                free_chunk_indexes.reserve(MAX_CHUNKS);
+                for(i = MAX_CHUNKS; 0<i; --i) free_chunk_indexes.push_back(i - 1);
+        }
+        ~Entities(){
+                for(unsigned i = 0; i<MAX_CHUNKS; ++i)
+                        if(chunks[i] != nullptr) deleteChunkMemory(chunks[i]);
+                releasePooledChunks();
+                if(snapshot_memory != nullptr) freeSnapshotMemory(snapshot_memory, snapshot_size);
+                delete[] entities_ids;
+                delete[] entities_positions;
+                delete[] free_entity_indexes;
+                delete[] chunks;
+        }
+        // Starts a new change version and returns it. A system that writes takes one once its jobs of a run are
+        // complete and passes it to View::changedSince the next time, to visit only the chunks written after its
+        // run. Writes carry the current version, so one taken before the run would also return the system's own.
+        inline uint32_t nextChangeVersion(){
+                return change_version.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+        inline uint32_t changeVersion() const {
+                return change_version.load(std::memory_order_relaxed);
+        }
+        // Chunks currently holding entities.
+        inline unsigned amountOfChunks() const {return MAX_CHUNKS - free_chunk_indexes.size();}
+        // Empty chunks kept around to be reused before asking the allocator for more.
+        inline unsigned amountOfPooledChunks() const {return pooled_chunks.size();}
+        inline void releasePooledChunks(){
+                for(Chunk* chunk : pooled_chunks) deleteChunkMemory(chunk);
+                pooled_chunks.clear();
+        }
+        struct CompactionStats{
+                unsigned chunks = 0;
+                size_t bytes = 0;
+        };
+        // Merges the partially filled chunks of every archetype, entities with shared components only into chunks
+        // holding the same values, and gives the emptied chunks back. Moved chunks are marked as changed and
+        // moved entities change row, so like playback it must not run while jobs use this Entities.
+        inline CompactionStats compact(){
+                return compact(std::numeric_limits<unsigned>::max());
+        }
+        // Incremental version moving at most max_entities entities, the next call resumes at the archetype
+        // where this one ran out of budget.
+        inline CompactionStats compact(unsigned max_entities){
+                DOTS_PROFILE_SCOPE("compact");
+                checkStructuralChange();
+                CompactionStats stats;
+                for(unsigned visited = 0; visited<MAP_CAPACITY_ARCHETYPES && max_entities != 0; ++visited){
+                        if(archetypes[compaction_cursor] != MAP_UNUSED_SPACE)
+                                stats.chunks += compactArchetype(compaction_cursor, max_entities);
+                        if(max_entities != 0) compaction_cursor = (compaction_cursor + 1)%MAP_CAPACITY_ARCHETYPES;
+                }
+                stats.bytes = (size_t)stats.chunks*CHUNK_SIZE;
+                return stats;
+        }
+        // Writes the whole world to path, the chunks as they are in memory so load can use them in place. Only the
+        // same Entities type built for the same platform reads it back. Like playback it must not run while jobs
+        // write to this Entities.
+        inline void save(const char* path) const {
+                DOTS_PROFILE_SCOPE("save");
+                SnapshotHeader header{};
+                header.magic = SNAPSHOT_MAGIC;
+                header.version = SNAPSHOT_VERSION;
+                header.max_entities = MAX_ENTITIES;
+                header.max_chunks = MAX_CHUNKS;
+                header.chunk_size = CHUNK_SIZE;
+                header.fingerprint = snapshotFingerprint();
+                header.change_version = change_version.load(std::memory_order_relaxed);
+                header.entities = unused_entity_index;
+                header.free_entities = free_entities_size;
+                for(unsigned i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i)
+                        if(archetypes[i] != MAP_UNUSED_SPACE) ++header.archetypes;
+                header.chunks = amountOfChunks();
+                const size_t metadata_size = snapshotMetadataSize(header);
+                header.chunks_offset = (metadata_size + CHUNK_ALIGNMENT - 1)/CHUNK_ALIGNMENT*CHUNK_ALIGNMENT;
+                header.size = header.chunks_offset + (uint64_t)header.chunks*CHUNK_SIZE;
+
+                std::vector<uint8_t> metadata(header.chunks_offset, 0);
+                uint8_t* cursor = metadata.data();
+                std::memcpy(cursor, &header, sizeof(header));
+                cursor += sizeof(header);
+                std::memcpy(cursor, entities_ids, header.entities*sizeof(EntityID));
+                cursor += header.entities*sizeof(EntityID);
+                std::memcpy(cursor, entities_positions, header.entities*sizeof(EntityPosition));
+                cursor += header.entities*sizeof(EntityPosition);
+                for(unsigned i = 0; i<free_entities_size; ++i, cursor += sizeof(uint32_t))
+                        std::memcpy(cursor, free_entity_indexes + (free_entities_front + i)%MAX_ENTITIES, sizeof(uint32_t));
+                for(uint16_t i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i){
+                        if(archetypes[i] == MAP_UNUSED_SPACE) continue;
+                        std::memcpy(cursor, &i, sizeof(i));
+                        cursor += sizeof(i);
+                }
+                for(unsigned i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i){
+                        if(archetypes[i] == MAP_UNUSED_SPACE) continue;
+                        std::memcpy(cursor, archetypes + i, sizeof(Archetype));
+                        cursor += sizeof(Archetype);
+                }
+                for(uint16_t ci = 0; ci<MAX_CHUNKS; ++ci){
+                        if(chunks[ci] == nullptr) continue;
+                        std::memcpy(cursor, &ci, sizeof(ci));
+                        cursor += sizeof(ci);
+                }
+
+                // Written next to path and renamed over it, truncating path in place would pull the pages from under
+                // chunks still mapped from it by an earlier load.
+                const std::string temporary_path = std::string(path) + ".tmp";
+                FILE* file = std::fopen(temporary_path.c_str(), "wb");
+                if(file == nullptr) throw std::runtime_error("Can't open snapshot!");
+                bool written = std::fwrite(metadata.data(), 1, metadata.size(), file) == metadata.size();
+                for(unsigned ci = 0; ci<MAX_CHUNKS && written; ++ci)
+                        if(chunks[ci] != nullptr) written = std::fwrite(chunks[ci], 1, CHUNK_SIZE, file) == CHUNK_SIZE;
+                if(std::fclose(file) != 0 || !written){
+                        std::remove(temporary_path.c_str());
+                        throw std::runtime_error("Can't write snapshot!");
+                }
+#ifdef _WIN32
+                std::remove(path);
+#endif
+                if(std::rename(temporary_path.c_str(), path) != 0){
+                        std::remove(temporary_path.c_str());
+                        throw std::runtime_error("Can't write snapshot!");
+                }
+        }
+        // Replaces the world with the snapshot at path. The file is mapped copy-on-write where the platform allows
+        // it and its chunks are used in place with only their pointers rebound, so the cost does not grow with the
+        // amount of entities beyond copying the entity map. Views selected before see the loaded world but must not
+        // be iterating, and ids handed out before are only valid if the snapshot holds them.
+        inline void load(const char* path){
+                DOTS_PROFILE_SCOPE("load");
+                checkStructuralChange();
+                size_t size = 0;
+                uint8_t* memory = readSnapshotFile(path, size);
+                if(!isValidSnapshot(memory, size)){
+                        freeSnapshotMemory(memory, size);
+                        throw std::runtime_error("Invalid snapshot!");
+                }
+                SnapshotHeader header;
+                std::memcpy(&header, memory, sizeof(header));
+
+                for(unsigned ci = 0; ci<MAX_CHUNKS; ++ci){
+                        if(chunks[ci] != nullptr) deleteChunkMemory(chunks[ci]);
+                        chunks[ci] = nullptr;
+                }
+                releasePooledChunks();
+                if(snapshot_memory != nullptr) freeSnapshotMemory(snapshot_memory, snapshot_size);
+                snapshot_memory = memory;
+                snapshot_size = size;
+                for(unsigned i = 0; i<MAP_CAPACITY_ARCHETYPES; ++i){
+                        archetypes[i] = MAP_UNUSED_SPACE;
+                        archetypes_chunks[i] = ArchetypeChunks();
+                }
+                for(Query& query : queries) query.archetype_indexes.clear();
+                compaction_cursor = 0;
+                change_version.store(header.change_version, std::memory_order_relaxed);
+
+                const uint8_t* cursor = memory + sizeof(header);
+                std::memcpy(entities_ids, cursor, header.entities*sizeof(EntityID));
+                std::fill(entities_ids + header.entities, entities_ids + MAX_ENTITIES, 0);
+                cursor += header.entities*sizeof(EntityID);
+                std::memcpy(entities_positions, cursor, header.entities*sizeof(EntityPosition));
+                cursor += header.entities*sizeof(EntityPosition);
+                std::memcpy(free_entity_indexes, cursor, header.free_entities*sizeof(uint32_t));
+                cursor += header.free_entities*sizeof(uint32_t);
+                unused_entity_index = header.entities;
+                free_entities_front = 0;
+                free_entities_size = header.free_entities;
+
+                const uint8_t* signatures = cursor + header.archetypes*sizeof(uint16_t);
+                for(unsigned a = 0; a<header.archetypes; ++a){
+                        uint16_t slot;
+                        Archetype archetype;
+                        std::memcpy(&slot, cursor + a*sizeof(uint16_t), sizeof(slot));
+                        std::memcpy(&archetype, signatures + a*sizeof(Archetype), sizeof(Archetype));
+                        setupArchetype(slot, archetype);
+                }
+                cursor = signatures + header.archetypes*sizeof(Archetype);
+                for(unsigned c = 0; c<header.chunks; ++c){
+                        uint16_t ci;
+                        std::memcpy(&ci, cursor + c*sizeof(uint16_t), sizeof(ci));
+                        Chunk* chunk = chunks[ci] = (Chunk*)(memory + header.chunks_offset + (size_t)c*CHUNK_SIZE);
+                        ArchetypeChunks& list = archetypes_chunks[chunk->archetype_index];
+                        chunk->layout = &list.layout;
+                        chunk->id = (EntityID*)(chunk->buffer + list.layout.ids);
+                        chunk->versions = (std::atomic<uint32_t>*)(chunk->buffer + list.layout.versions);
+                        if(list.chunks.size() <= chunk->list_index) list.chunks.resize(chunk->list_index + 1);
+                        list.chunks[chunk->list_index] = ci;
+                        if(chunk->size == chunk->capacity) ++list.full;
+                }
+                free_chunk_indexes.clear();
+                for(unsigned ci = MAX_CHUNKS; 0<ci; --ci)
+                        if(chunks[ci - 1] == nullptr) free_chunk_indexes.push_back(ci - 1);
+        }
+        inline EntityID createEntity(){
+                const unsigned emi = allocateEntityIndex();
+                entities_positions[emi].chunk = NO_CHUNK;
+                return entities_ids[emi];
+        }
+        inline bool isAlive(const EntityID id) const {
+                const unsigned emi = entityIndex(id);
+                return emi < MAX_ENTITIES && entities_ids[emi] == id && !isPlaceholder(id);
+        }
+        // False as well when the entity is not alive.
+        template<typename... Subset>
+        inline bool hasComponents(const EntityID id) const {
+                if(!isAlive(id) || entities_positions[entityIndex(id)].chunk == NO_CHUNK) return false;
+                return SignatureTraits<Archetype>::contains(entityArchetype(entityIndex(id)), getArchetype<Subset...>::value);
+        }
+        void destroyEntity(const EntityID id){
+                checkStructuralChange();
+                const unsigned emi = findEntityIndex(id);
+                if(entities_positions[emi].chunk != NO_CHUNK) removeEntityFromArchetypeChunk(emi);
+                freeEntityIndex(emi);
+        }
+        template<typename... NewComponents>
+        void addComponents(const EntityID id, const NewComponents&... components){
+                constexpr Archetype addition_archetype = getArchetype<NewComponents...>::value;
+                checkStructuralChange();
+                const unsigned emi = findEntityIndex(id);
+                SharedValues values{};
+                if(entities_positions[emi].chunk == NO_CHUNK){
+                        writeSharedValues(values, components...);
+                        addEntityToArchetypeChunk(emi, findArchetypeChunk(addition_archetype, &values), components...);
+                }else{
+                        Chunk& chunk = *chunks[entities_positions[emi].chunk];
+                        const unsigned ami = chunk.archetype_index;
+                        const ArchetypeEdge& edge = findEdge(ami, addition_archetype, EDGE_ADD);
+                        const bool shared = (archetypes[edge.target] & SHARED_ARCHETYPE) != Archetype();
+                        if(shared){
+                                readSharedValues(chunk, values);
+                                writeSharedValues(values, components...);
+                        }
+                        // A different shared value moves the entity to another chunk of the same archetype.
+                        if(edge.target == ami && (!shared || hasSharedValues(chunk, values))){
+                                insertComponentsToChunk(chunk, entities_positions[emi].chunk_row, components...);
+                                markChanged(chunk, addition_archetype);
+                        }
+                        else transferEntityToArchetypeChunk(emi, findArchetypeChunkAt(edge.target, &values), edge.copies, components...);
+                }
+        }
+        // Creates count entities with the given components. initializer(i, components&...) sets up the
+        // value-initialized components of the i-th entity in place. ids may be null.
+        template<typename... NewComponents, typename Initializer, std::enable_if_t<!std::is_pointer<Initializer>::value, bool> = true>
+        void createEntities(const unsigned count, EntityID* ids, const Initializer& initializer){
+                static_assert((getArchetype<NewComponents...>::value & SHARED_ARCHETYPE) == Archetype(), "Shared components are set with addComponents");
+                checkStructuralChange();
+                createEntitiesInArchetype(count, ids, getArchetype<NewComponents...>::value, [&initializer](Chunk& chunk, const unsigned row, const unsigned first, const unsigned n){
+                        for(unsigned i = 0; i<n; ++i) initializer(first + i, constructComponent<NewComponents>(chunk, row + i)...);
+                });
+        }
+        // Creates count entities, the i-th one taking components[i] of every array. ids may be null.
+        template<typename... NewComponents>
+        void createEntities(const unsigned count, EntityID* ids, const NewComponents*... components){
+                static_assert((getArchetype<NewComponents...>::value & SHARED_ARCHETYPE) == Archetype(), "Shared components are set with addComponents");
+                checkStructuralChange();
+                createEntitiesInArchetype(count, ids, getArchetype<NewComponents...>::value, [&](Chunk& chunk, const unsigned row, const unsigned first, const unsigned n){
+                        copyComponentColumns(chunk, row, first, n, components...);
+                });
+        }
+         template<typename... OldComponents>
+        void delComponents(const EntityID id){
+                constexpr Archetype subtraction_archetype = getArchetype<OldComponents...>::value;
+                checkStructuralChange();
+                const unsigned emi = findEntityIndex(id);
+                if(entities_positions[emi].chunk == NO_CHUNK) return;
+                const Chunk& chunk = *chunks[entities_positions[emi].chunk];
+                const ArchetypeEdge& edge = findEdge(chunk.archetype_index, subtraction_archetype, EDGE_DEL);
+                if(edge.target == chunk.archetype_index) return;
+                if(edge.target == NO_TARGET){
+                        removeEntityFromArchetypeChunk(emi);
+                        return;
+                }
+                SharedValues values{};
+                readSharedValues(chunk, values);
+                transferEntityToArchetypeChunk(emi, findArchetypeChunkAt(edge.target, &values), edge.copies);
+        }
+        template<typename... Subset>
+        inline View<Subset...> select() {
+                return View<Subset...>(this);
+        }
+        // Waits for every job scheduled through Views of this Entities, structural changes are safe afterwards.
+        template<typename Jobs>
+        inline void completeJobs(Jobs& jobs){
+                std::vector<JobHandle> handles;
+                {
+                        std::lock_guard<std::mutex> lg(component_jobs_lock);
+                        for(const ComponentJobs& access : component_jobs){
+                                handles.push_back(access.writer);
+                                handles.insert(handles.end(), access.readers.begin(), access.readers.end());
+                        }
+                }
+                for(const JobHandle& handle : handles) jobs.complete(handle);
+        }
+        inline void playback(CommandBuffer& buffer){
+                DOTS_PROFILE_SCOPE("playback");
+                playback(&buffer, 1);
+        }
+        // Folds every command into one final state per entity, then applies the entities grouped by target
+        // archetype so each one is moved at most once and target chunks are looked up once per group.
+        // Commands on entities that are not alive are dropped. Must not run concurrently with jobs touching
+        // these entities. The buffers are cleared.
+        void playback(CommandBuffer* buffers, const unsigned nbuffers){
+                checkStructuralChange();
+                pending_entities.clear();
+                pending_writes.clear();
+                pending_indexes.clear();
+                std::vector<EntityID> placeholders;
+                for(unsigned b = 0; b<nbuffers; ++b){
+                        CommandBuffer& buffer = buffers[b];
+                        placeholders.assign(buffer.placeholders, 0);
+                        for(size_t position = 0; position<buffer.arena.size();){
+                                typename CommandBuffer::Header header;
+                                std::memcpy(&header, buffer.arena.data() + position, sizeof(header));
+                                const uint8_t* payload = buffer.arena.data() + position + sizeof(header);
+                                position += header.size;
+                                EntityID id = header.id;
+                                if(isPlaceholder(id)){
+                                        if(header.command == CommandBuffer::CREATE) placeholders[id] = createEntity();
+                                        id = id < placeholders.size() ? placeholders[id] : 0;
+                                }
+                                PendingEntity& entity = pendingEntity(id);
+                                if(entity.destroyed) continue;
+                                switch(header.command){
+                                        case CommandBuffer::CREATE: break;
+                                        case CommandBuffer::DESTROY: entity.destroyed = true; break;
+                                        case CommandBuffer::DEL: entity.archetype &= ~header.archetype; break;
+                                        case CommandBuffer::ADD:
+                                                entity.archetype |= header.archetype;
+                                                for(unsigned i = 0; i<sizeof...(Components); ++i){
+                                                        if(!(header.archetype & componentBit(i))) continue;
+                                                        const uint32_t write = pending_writes.size();
+                                                        pending_writes.push_back(PendingWrite{payload, NO_PENDING_WRITE, (uint16_t)i});
+                                                        payload += COMPONENT_SIZE[i];
+                                                        if(entity.last_write == NO_PENDING_WRITE) entity.first_write = write;
+                                                        else pending_writes[entity.last_write].next = write;
+                                                        entity.last_write = write;
+                                                }
+                                                break;
+                                }
+                        }
+                }
+
+                pending_order.resize(pending_entities.size());
+                for(uint32_t i = 0; i<pending_order.size(); ++i) pending_order[i] = i;
+                std::sort(pending_order.begin(), pending_order.end(), [this](uint32_t a, uint32_t b){
+                        const PendingEntity& first = pending_entities[a];
+                        const PendingEntity& second = pending_entities[b];
+                        if(first.destroyed != second.destroyed) return first.destroyed;
+                        return first.archetype < second.archetype;
+                });
+
+                unsigned ci = NO_CHUNK;
+                Archetype group{};
+                for(const uint32_t i : pending_order){
+                        const PendingEntity& entity = pending_entities[i];
+                        if(!entity.alive) continue;
+                        const unsigned emi = entityIndex(entity.id);
+                        const bool in_chunk = entities_positions[emi].chunk != NO_CHUNK;
+                        if(entity.destroyed){
+                                destroyEntity(entity.id);
+                                continue;
+                        }
+                        if(entity.archetype == Archetype()){
+                                if(in_chunk) removeEntityFromArchetypeChunk(emi);
+                                continue;
+                        }
+                        // Entities with shared components pick their chunk by value, skipping the group cache.
+                        const bool shared = (entity.archetype & SHARED_ARCHETYPE) != Archetype();
+                        SharedValues values{};
+                        if(shared){
+                                if(in_chunk) readSharedValues(*chunks[entities_positions[emi].chunk], values);
+                                for(uint32_t w = entity.first_write; w != NO_PENDING_WRITE; w = pending_writes[w].next){
+                                        const PendingWrite& write = pending_writes[w];
+                                        if(SHARED_ARCHETYPE & componentBit(write.component))
+                                                std::memcpy(values.bytes + payloadOffset(SHARED_ARCHETYPE, write.component), write.data, COMPONENT_SIZE[write.component]);
+                                }
+                        }
+                        if(!in_chunk || entityArchetype(emi) != entity.archetype || (shared && !hasSharedValues(*chunks[entities_positions[emi].chunk], values))){
+                                unsigned target;
+                                if(shared){
+                                        target = findArchetypeChunk(entity.archetype, &values);
+                                        ci = NO_CHUNK;
+                                }else{
+                                        if(ci == NO_CHUNK || group != entity.archetype || chunks[ci]->size == chunks[ci]->capacity){
+                                                group = entity.archetype;
+                                                ci = findArchetypeChunk(group);
+                                        }
+                                        target = ci;
+                                }
+                                if(in_chunk) transferEntityToArchetypeChunk(emi, target, findTransition(chunks[entities_positions[emi].chunk]->archetype_index, chunks[target]->archetype_index).copies);
+                                else addEntityToArchetypeChunk(emi, target);
+                        }
+                        Chunk& chunk = *chunks[entities_positions[emi].chunk];
+                        const unsigned row = entities_positions[emi].chunk_row;
+                        Archetype written{};
+                        for(uint32_t w = entity.first_write; w != NO_PENDING_WRITE; w = pending_writes[w].next){
+                                const PendingWrite& write = pending_writes[w];
+                                if(entity.archetype & componentBit(write.component)){
+                                        std::memcpy(chunk.component(write.component) + row*COLUMN_SIZE[write.component], write.data, COLUMN_SIZE[write.component]);
+                                        written |= componentBit(write.component);
+                                }
+                        }
+                        if(written != Archetype()) markChanged(chunk, written);
+                }
+                for(unsigned b = 0; b<nbuffers; ++b) buffers[b].clear();
+        }
+};
+
+// What an idle worker does after idle_spins empty polls of the queues: keep spinning, yield its time slice,
+// or sleep until a job is queued. Spinning answers new jobs fastest but keeps every worker's core busy, parking
+// frees the cores at the cost of a condition variable wake-up.
+enum IdleStrategy : uint8_t {IDLE_SPIN, IDLE_YIELD, IDLE_PARK};
+
+struct JobSystemOptions{
+        unsigned workers = std::thread::hardware_concurrency();
+        bool main_thread_will_work = false;
+        // Pins worker i to core (first_core + i) modulo the core count, only on Linux for now.
+        bool pin_workers = false;
+        unsigned first_core = 0;
+        IdleStrategy idle = IDLE_PARK;
+        unsigned idle_spins = 64;
+};
+
+template<unsigned JOBS_QUEUE_CAPACITY>
+class JobSystem{
+        static_assert(JOBS_QUEUE_CAPACITY != 0 && (JOBS_QUEUE_CAPACITY & (JOBS_QUEUE_CAPACITY - 1)) == 0, "JOBS_QUEUE_CAPACITY must be a power of two");
+        static constexpr unsigned JOBS_QUEUE_MASK = JOBS_QUEUE_CAPACITY - 1;
+        static constexpr unsigned CACHE_LINE_SIZE = 64;
+        static constexpr unsigned JOB_DATA_SIZE = 96;
+        static constexpr unsigned MAX_CONTINUATIONS = 12;
+
+        // generation is odd while the job is pending and even once its slot is free again.
+        struct alignas(CACHE_LINE_SIZE) Job{
+                alignas(std::max_align_t) uint8_t data[JOB_DATA_SIZE];
+                void (*function)(void*);
+                std::atomic<uint32_t> generation{0};
+                std::atomic<unsigned> dependencies{0};
+                std::atomic_flag continuations_lock = ATOMIC_FLAG_INIT;
+                unsigned ncontinuations = 0;
+                Job* continuations[MAX_CONTINUATIONS];
+                // The continuations past MAX_CONTINUATIONS, only allocated for jobs many others wait for.
+                std::vector<Job*> more_continuations;
+#ifdef DOTS_PROFILE
+                const char* name;
+                uint64_t ready;
+#endif
+        };
+
+        // Chase-Lev deque: the owner pushes and pops at the bottom, thieves steal from the top.
+        struct alignas(CACHE_LINE_SIZE) WorkQueue{
+                std::atomic<int64_t> top{0};
+                alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom{0};
+                std::atomic<Job*> jobs[JOBS_QUEUE_CAPACITY];
+
+                inline bool push(Job* job){
+                        const int64_t b = bottom.load(std::memory_order_relaxed);
+                        const int64_t t = top.load(std::memory_order_acquire);
+                        if(b - t >= (int64_t)JOBS_QUEUE_CAPACITY) return false;
+                        jobs[b & JOBS_QUEUE_MASK].store(job, std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_release);
+                        bottom.store(b + 1, std::memory_order_relaxed);
+                        return true;
+                }
+                inline Job* pop(){
+                        const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+                        bottom.store(b, std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        int64_t t = top.load(std::memory_order_relaxed);
+                        if(b < t){
+                                bottom.store(b + 1, std::memory_order_relaxed);
+                                return nullptr;
+                        }
+                        Job* job = jobs[b & JOBS_QUEUE_MASK].load(std::memory_order_relaxed);
+                        if(t == b){
+                                if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) job = nullptr;
+                                bottom.store(b + 1, std::memory_order_relaxed);
+                        }
+                        return job;
+                }
+                inline Job* steal(){
+                        int64_t t = top.load(std::memory_order_acquire);
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        const int64_t b = bottom.load(std::memory_order_acquire);
+                        if(b <= t) return nullptr;
+                        Job* job = jobs[t & JOBS_QUEUE_MASK].load(std::memory_order_relaxed);
+                        if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+                        return job;
+                }
+        };
+
+        struct Worker{
+                WorkQueue queue;
+                std::vector<std::unique_ptr<Job[]>> pool;
+                unsigned pool_next = 0;
+        };
+
+        struct ThreadContext{
+                const void* system;
+                unsigned index;
+        };
+
+        unsigned nworkers;
+        unsigned nqueues;
+        std::thread::id owner;
+        std::unique_ptr<Worker[]> workers;
+        std::vector<std::thread> threads;
+        std::atomic<bool> running{true};
+        std::atomic<unsigned> unfinished_jobs{0};
+        std::atomic<int> queued_jobs{0};
+        std::atomic<unsigned> sleepers{0};
+        std::mutex sleep_lock;
+        std::condition_variable sleep_cv;
+        // Jobs submitted while the submitting thread's queue was full, taken once no queue has work.
+        std::mutex overflow_lock;
+        std::deque<Job*> overflow_jobs;
+        std::atomic<unsigned> overflow_size{0};
+        std::mutex foreign_lock;
+        IdleStrategy idle_strategy;
+        unsigned idle_spins;
+
+        static inline ThreadContext& threadContext(){
+                static thread_local ThreadContext context{nullptr, 0};
+                return context;
+        }
+
+        template<typename Function>
+        static void invoke(void* data){
+                Function& function = *reinterpret_cast<Function*>(data);
+                function();
+                function.~Function();
+        }
+
+        // Threads other than the workers and the owner get index nqueues, they share one job pool under
+        // foreign_lock and queue their jobs to the overflow list.
+        inline unsigned currentQueue() const {
+                const ThreadContext& context = threadContext();
+                if(context.system == this) return context.index;
+                if(std::this_thread::get_id() == owner) return nqueues - 1;
+                return nqueues;
+        }
+
+        inline Job* findJob(const unsigned index){
+                Job* job = index < nqueues ? workers[index].queue.pop() : nullptr;
+                for(unsigned i = 1; job == nullptr && i<=nqueues; ++i)
+                        if((index + i) % nqueues != index) job = workers[(index + i) % nqueues].queue.steal();
+                if(job == nullptr && overflow_size.load(std::memory_order_acquire) != 0){
+                        std::lock_guard<std::mutex> lg(overflow_lock);
+                        if(!overflow_jobs.empty()){
+                                job = overflow_jobs.front();
+                                overflow_jobs.pop_front();
+                                overflow_size.store(overflow_jobs.size(), std::memory_order_relaxed);
+                        }
+                }
+                if(job != nullptr) queued_jobs.fetch_sub(1, std::memory_order_relaxed);
+                return job;
+        }
+
+        static inline void lockContinuations(Job* job){
+                while(job->continuations_lock.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+        }
+
+        static inline void unlockContinuations(Job* job){
+                job->continuations_lock.clear(std::memory_order_release);
+        }
+
+        inline void execute(const unsigned index, Job* job){
+#ifdef DOTS_PROFILE
+                Profiler& profiler = Profiler::instance();
+                const uint64_t start = profiler.now();
+                job->function(job->data);
+                profiler.record(job->name, start, profiler.now(), start - job->ready, index);
+#else
+                job->function(job->data);
+#endif
+                Job* continuations[MAX_CONTINUATIONS];
+                std::vector<Job*> more_continuations;
+                lockContinuations(job);
+                const unsigned ncontinuations = job->ncontinuations;
+                std::copy(job->continuations, job->continuations + ncontinuations, continuations);
+                more_continuations.swap(job->more_continuations);
+                job->generation.fetch_add(1, std::memory_order_release);
+                unlockContinuations(job);
+                for(unsigned i = 0; i<ncontinuations; ++i) release(index, continuations[i]);
+                for(Job* continuation : more_continuations) release(index, continuation);
+                unfinished_jobs.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        inline bool runJob(const unsigned index){
+                Job* job = findJob(index);
+                if(job == nullptr) return false;
+                execute(index, job);
+                return true;
+        }
+
+        // Pending slots are skipped rather than waited on, one of them may hold the job this thread is running.
+        // The pool only grows when every slot is pending.
+        inline Job* allocateJob(const unsigned index){
+                std::unique_lock<std::mutex> ul(foreign_lock, std::defer_lock);
+                if(index == nqueues) ul.lock();
+                Worker& worker = workers[index];
+                const unsigned pool_size = worker.pool.size()*JOBS_QUEUE_CAPACITY;
+                Job* job = nullptr;
+                for(unsigned i = 0; i<pool_size; ++i){
+                        const unsigned slot = worker.pool_next++ % pool_size;
+                        job = &worker.pool[slot/JOBS_QUEUE_CAPACITY][slot & JOBS_QUEUE_MASK];
+                        if((job->generation.load(std::memory_order_acquire) & 1) == 0) break;
+                        job = nullptr;
+                }
+                if(job == nullptr){
+                        worker.pool.emplace_back(new Job[JOBS_QUEUE_CAPACITY]);
+                        worker.pool_next = pool_size + 1;
+                        job = &worker.pool.back()[0];
+                }
+                job->ncontinuations = 0;
+                job->dependencies.store(1, std::memory_order_relaxed);
+                job->generation.fetch_add(1, std::memory_order_relaxed);
+                return job;
+        }
+
+        // Returns false when the dependency already finished and nothing has to be waited for.
+        inline bool addContinuation(const JobHandle& dependency, Job* job){
+                Job* parent = (Job*) dependency.job;
+                if(parent == nullptr) return false;
+                lockContinuations(parent);
+                if(parent->generation.load(std::memory_order_acquire) != dependency.generation){
+                        unlockContinuations(parent);
+                        return false;
+                }
+                job->dependencies.fetch_add(1, std::memory_order_relaxed);
+                if(parent->ncontinuations < MAX_CONTINUATIONS) parent->continuations[parent->ncontinuations++] = job;
+                else parent->more_continuations.push_back(job);
+                unlockContinuations(parent);
+                return true;
+        }
+
+        inline void release(const unsigned index, Job* job){
+                if(job->dependencies.fetch_sub(1, std::memory_order_acq_rel) == 1) submit(index, job);
+        }
+
+        inline void submit(const unsigned index, Job* job){
+#ifdef DOTS_PROFILE
+                job->ready = Profiler::instance().now();
+#endif
+                if(index == nqueues || !workers[index].queue.push(job)){
+                        std::lock_guard<std::mutex> lg(overflow_lock);
+                        overflow_jobs.push_back(job);
+                        overflow_size.store(overflow_jobs.size(), std::memory_order_release);
+                }
+                queued_jobs.fetch_add(1, std::memory_order_seq_cst);
+                if(sleepers.load(std::memory_order_seq_cst) != 0){
+                        {std::lock_guard<std::mutex> lg(sleep_lock);}
+                        sleep_cv.notify_one();
+                }
+        }
+
+        inline void park(){
+#ifdef DOTS_PROFILE
+                const uint64_t start = Profiler::instance().now();
+#endif
+                std::unique_lock<std::mutex> ul(sleep_lock);
+                sleepers.fetch_add(1, std::memory_order_seq_cst);
+                sleep_cv.wait(ul, [this]{
+                        return queued_jobs.load(std::memory_order_seq_cst) > 0 || !running.load(std::memory_order_relaxed);
+                });
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+#ifdef DOTS_PROFILE
+                Profiler::instance().record("idle", start, Profiler::instance().now());
+#endif
+        }
+
+        static inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+                _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+                __asm__ __volatile__("yield");
+#endif
+        }
+
+        // Backs off after idle empty polls in a row, only workers park since nothing wakes a waiting owner.
+        inline void idleWait(const unsigned idle, const bool may_park){
+                if(idle_strategy == IDLE_SPIN || (idle_strategy == IDLE_YIELD && idle < idle_spins)) cpuRelax();
+                else if(idle_strategy == IDLE_YIELD || idle < idle_spins || !may_park) std::this_thread::yield();
+                else park();
+        }
+
+        static inline void pinThread(std::thread& thread, const unsigned core){
+#if defined(__linux__)
+                cpu_set_t cores;
+                CPU_ZERO(&cores);
+                CPU_SET(core, &cores);
+                pthread_setaffinity_np(thread.native_handle(), sizeof(cores), &cores);
+#else
+                (void)thread;
+                (void)core;
+#endif
+        }
+
+        void loop(const unsigned index){
+                threadContext() = {this, index};
+#ifdef DOTS_PROFILE
+                Profiler::instance().nameThread("worker " + std::to_string(index));
+#endif
+                unsigned idle = 0;
+                while(running.load(std::memory_order_relaxed)){
+                        if(runJob(index)) idle = 0;
+                        else idleWait(++idle, true);
+                }
+        }
+
+        template<typename Function>
+        inline JobHandle scheduleAfter(const Function& function, const JobHandle* first, const JobHandle* last){
+                static_assert(sizeof(Function) <= JOB_DATA_SIZE, "Job captures do not fit in the job storage!");
+                static_assert(alignof(Function) <= alignof(std::max_align_t), "Job captures are over-aligned!");
+                const unsigned index = currentQueue();
+                Job* job = allocateJob(index);
+                new (job->data) Function(function);
+                job->function = &invoke<Function>;
+#ifdef DOTS_PROFILE
+                job->name = Profiler::label() != nullptr ? Profiler::label() : "job";
+#endif
+                unfinished_jobs.fetch_add(1, std::memory_order_relaxed);
+                for(; first != last; ++first) addContinuation(*first, job);
+                const JobHandle handle{job, job->generation.load(std::memory_order_relaxed)};
+                release(index, job);
+                return handle;
+        }
+
+        public:
+        template<typename Function>
+        inline JobHandle schedule(const Function& function, std::initializer_list<JobHandle> dependencies = {}){
+                return scheduleAfter(function, dependencies.begin(), dependencies.end());
+        }
+        template<typename Function>
+        inline JobHandle schedule(const Function& function, const JobHandle& dependency){
+                return scheduleAfter(function, &dependency, &dependency + 1);
+        }
+        template<typename Function>
+        inline JobHandle schedule(const Function& function, const std::vector<JobHandle>& dependencies){
+                return scheduleAfter(function, dependencies.data(), dependencies.data() + dependencies.size());
+        }
+        inline JobHandle combine(std::initializer_list<JobHandle> dependencies){
+                return schedule([]{}, dependencies);
+        }
+        inline JobHandle combine(const std::vector<JobHandle>& dependencies){
+                return schedule([]{}, dependencies);
+        }
+        inline bool isComplete(const JobHandle& handle) const {
+                return handle.job == nullptr || ((const Job*) handle.job)->generation.load(std::memory_order_acquire) != handle.generation;
+        }
+        // Blocks the calling thread, helping to run jobs, until the job and everything it depends on is finished.
+        inline void complete(const JobHandle& handle){
+                if(isComplete(handle)) return;
+                DOTS_PROFILE_SCOPE("complete");
+                const unsigned index = currentQueue();
+                unsigned idle = 0;
+                while(!isComplete(handle)){
+                        if(runJob(index)) idle = 0;
+                        else idleWait(++idle, false);
+                }
+        }
+        // Blocks the calling thread, helping to run jobs, until every scheduled job is finished, including the
+        // ones other threads schedule meanwhile. Must not be called from inside a job. Jobs that only have to
+        // run after others, without the caller waiting, take their JobHandles as dependencies instead.
+        inline void scheduleSyncPoint(){
+                DOTS_PROFILE_SCOPE("sync_point");
+                const unsigned index = currentQueue();
+                unsigned idle = 0;
+                while(unfinished_jobs.load(std::memory_order_acquire) != 0){
+                        if(runJob(index)) idle = 0;
+                        else idleWait(++idle, false);
+                }
+        }
+        // Runs function alone, waiting like scheduleSyncPoint before and after it.
+        template<typename Function>
+        inline void scheduleNotConcurrent(const Function& function){
+                scheduleSyncPoint();
+                schedule(function);
+                scheduleSyncPoint();
+        }
+        inline void work(){
+                if(!runJob(currentQueue())) std::this_thread::yield();
+        }
+        JobSystem(bool mainThreadWillWork, unsigned workers_count = std::thread::hardware_concurrency()):JobSystem(JobSystemOptions{workers_count, mainThreadWillWork}){}
+        // The thread constructing the JobSystem is its owner, it runs jobs while it waits in complete or scheduleSyncPoint.
+        JobSystem(const JobSystemOptions& options){
+                nworkers = (1u < options.workers) ? options.workers : 1u;
+                nqueues = nworkers + 1;
+                owner = std::this_thread::get_id();
+                idle_strategy = options.idle;
+                idle_spins = options.idle_spins;
+                workers.reset(new Worker[nqueues + 1]);
+                for(unsigned i = 0; i<nqueues; ++i) workers[i].pool.emplace_back(new Job[JOBS_QUEUE_CAPACITY]);
+                threads.reserve(nworkers);
+                for (unsigned i = 0; i < nworkers; ++i)
+                        threads.emplace_back([this, i] () {this->loop(i);});
+                const unsigned cores = std::thread::hardware_concurrency();
+                if(options.pin_workers && cores != 0)
+                        for(unsigned i = 0; i<nworkers; ++i) pinThread(threads[i], (options.first_core + i)%cores);
+                if(options.main_thread_will_work) nworkers += 1;
+        }
+        ~JobSystem(){
+                while(unfinished_jobs.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+                {
+                        std::lock_guard<std::mutex> lg(sleep_lock);
+                        running.store(false, std::memory_order_relaxed);
+                }
+                sleep_cv.notify_all();
+                for(auto& thread : threads) thread.join();
+        }
+        unsigned amountOfWorkers() const {return nworkers;}
+        // Queues are numbered 0..amountOfQueues()-1, one per worker plus one for the owner thread.
+        unsigned amountOfQueues() const {return nqueues;}
+        unsigned currentQueueIndex() const {
+                const unsigned index = currentQueue();
+                if(index == nqueues) throw std::runtime_error("Thread not registered in JobSystem!");
+                return index;
+        }
+        
+};
+
+// A hashed uniform grid over the Position of the entities of a World for neighbourhood queries. Position needs
+// float members x, y and z. update() only revisits the chunks whose Position changed since the last update or
+// rebuild. Cells and the cell of every entity are split into SHARDS maps so rebuild can fill them in parallel.
+template<typename World, typename Position>
+class SpatialGrid{
+        static constexpr unsigned SHARDS = 16;
+        static constexpr unsigned SHARDS_PER_FAN_OUT = 4;
+        static constexpr int32_t CELL_COORDINATE_LIMIT = 1 << 20;
+
+        struct Entry{
+                EntityID id;
+                float x;
+                float y;
+                float z;
+        };
+        struct CellEntry{
+                uint64_t cell;
+                Entry entry;
+        };
+        struct EntityCell{
+                EntityID id;
+                uint64_t cell;
+        };
+        // What the first pass of rebuild hands to the second, bucketed by shard.
+        struct Staging{
+                std::mutex lock;
+                std::vector<CellEntry> entries[SHARDS];
+                std::vector<EntityCell> cells[SHARDS];
+        };
+
+        float cell_size;
+        float inverse_cell_size;
+        std::unordered_map<uint64_t, std::vector<Entry>> cells[SHARDS];
+        std::unordered_map<EntityID, uint64_t> entity_cells[SHARDS];
+        int32_t bounds_min[3];
+        int32_t bounds_max[3];
+        uint32_t version = 0;
+        bool built = false;
+
+        inline int32_t cellCoordinate(const float value) const {
+                const float cell = std::floor(value*inverse_cell_size);
+                return (int32_t)std::max<float>(-CELL_COORDINATE_LIMIT, std::min<float>(CELL_COORDINATE_LIMIT - 1, cell));
+        }
+
+        static inline uint64_t cellKey(const int32_t x, const int32_t y, const int32_t z){
+                return ((uint64_t)(x + CELL_COORDINATE_LIMIT) << 42) | ((uint64_t)(y + CELL_COORDINATE_LIMIT) << 21) | (uint64_t)(z + CELL_COORDINATE_LIMIT);
+        }
+
+        inline uint64_t cellKey(const float x, const float y, const float z) const {
+                return cellKey(cellCoordinate(x), cellCoordinate(y), cellCoordinate(z));
+        }
+
+        static inline unsigned cellShard(const uint64_t cell){
+                return (cell*0x9E3779B97F4A7C15ull) >> 60;
+        }
+
+        static inline unsigned entityShard(const EntityID id){
+                return (id*0x9E3779B9u) >> 28;
+        }
+
+        inline void growBounds(const uint64_t cell){
+                const int32_t coordinates[3] = {(int32_t)(cell >> 42) - CELL_COORDINATE_LIMIT, (int32_t)((cell >> 21) & 0x1fffff) - CELL_COORDINATE_LIMIT, (int32_t)(cell & 0x1fffff) - CELL_COORDINATE_LIMIT};
+                for(unsigned axis = 0; axis<3; ++axis){
+                        bounds_min[axis] = std::min(bounds_min[axis], coordinates[axis]);
+                        bounds_max[axis] = std::max(bounds_max[axis], coordinates[axis]);
+                }
+        }
+
+        inline void removeFromCell(const uint64_t cell, const EntityID id){
+                auto found = cells[cellShard(cell)].find(cell);
+                std::vector<Entry>& entries = found->second;
+                for(unsigned i = 0; i<entries.size(); ++i){
+                        if(entries[i].id != id) continue;
+                        entries[i] = entries.back();
+                        entries.pop_back();
+                        break;
+                }
+                if(entries.empty()) cells[cellShard(cell)].erase(found);
+        }
+
+        inline void place(const Entry& entry){
+                const uint64_t cell = cellKey(entry.x, entry.y, entry.z);
+                auto& located = entity_cells[entityShard(entry.id)];
+                auto found = located.find(entry.id);
+                if(found != located.end()){
+                        if(found->second == cell){
+                                for(Entry& existing : cells[cellShard(cell)][cell])
+                                        if(existing.id == entry.id) existing = entry;
+                                return;
+                        }
+                        removeFromCell(found->second, entry.id);
+                        found->second = cell;
+                }else located.emplace(entry.id, cell);
+                cells[cellShard(cell)][cell].push_back(entry);
+                growBounds(cell);
+        }
+
+        inline void clearCells(){
+                for(unsigned s = 0; s<SHARDS; ++s){
+                        cells[s].clear();
+                        entity_cells[s].clear();
+                }
+                for(unsigned axis = 0; axis<3; ++axis){
+                        bounds_min[axis] = CELL_COORDINATE_LIMIT;
+                        bounds_max[axis] = -CELL_COORDINATE_LIMIT;
+                }
+        }
+
+        // Drops the entities that were destroyed or lost their Position.
+        inline void removeStale(const World& world){
+                for(unsigned s = 0; s<SHARDS; ++s){
+                        for(auto located = entity_cells[s].begin(); located != entity_cells[s].end();){
+                                if(world.template hasComponents<Position>(located->first)) ++located;
+                                else{
+                                        removeFromCell(located->second, located->first);
+                                        located = entity_cells[s].erase(located);
+                                }
+                        }
+                }
+        }
+
+        template<typename Function>
+        inline void forEachInCell(const int32_t x, const int32_t y, const int32_t z, const Function& function) const {
+                const uint64_t cell = cellKey(x, y, z);
+                const auto& shard = cells[cellShard(cell)];
+                auto found = shard.find(cell);
+                if(found == shard.end()) return;
+                for(const Entry& entry : found->second) function(entry);
+        }
+
+        template<typename Function>
+        inline void forEachCell(const Function& function) const {
+                for(unsigned s = 0; s<SHARDS; ++s)
+                        for(const auto& cell : cells[s])
+                                for(const Entry& entry : cell.second) function(entry);
+        }
+
+        static inline float squaredDistance(const Entry& entry, const Position& point){
+                const float dx = entry.x - point.x;
+                const float dy = entry.y - point.y;
+                const float dz = entry.z - point.z;
+                return dx*dx + dy*dy + dz*dz;
+        }
+
+        public:
+        // cell_size is best around the radius of the usual query.
+        SpatialGrid(const float _cell_size):cell_size{_cell_size}, inverse_cell_size{1.0f/_cell_size}{
+                if(!(_cell_size > 0)) throw std::runtime_error("Cell size must be positive!");
+                clearCells();
+        }
+
+        // Moves the entities of the chunks whose Position changed since the last update or rebuild, adds new ones
+        // and drops those that are gone. Jobs writing Position must be complete, see View::completeDependencies.
+        inline void update(World& world){
+                const uint32_t since = version;
+                version = world.nextChangeVersion();
+                const auto view = world.template select<const Position>();
+                size_t count = 0;
+                for(const auto& subview : built ? view.changedSince(since) : view){
+                        const Position* positions = subview.template read<Position>();
+                        const EntityID* ids = subview.readId();
+                        for(unsigned i = 0; i<subview.size(); ++i) place(Entry{ids[i], positions[i].x, positions[i].y, positions[i].z});
+                }
+                for(const auto& subview : view) count += subview.size();
+                built = true;
+                // Every entity with a Position was placed at least once, so extra ones are gone from the World.
+                if(size() != count) removeStale(world);
+        }
+
+        // Refills the grid from scratch in parallel: the batches of a View job sort the entities by shard, then
+        // one job per shard fills its cells and one its entity cells. Returns without waiting for dependency, the
+        // grid must not be used until the returned job completes.
+        template<typename Jobs>
+        inline JobHandle rebuild(World& world, Jobs& jobs, const JobHandle& dependency = JobHandle()){
+                clearCells();
+                version = world.nextChangeVersion();
+                built = true;
+                auto staging = std::make_shared<Staging>();
+                const JobHandle sorted = world.template select<const Position>().parallelForChunks(jobs, [this, staging](const auto& subview){
+                        std::vector<CellEntry> entries[SHARDS];
+                        std::vector<EntityCell> located[SHARDS];
+                        const Position* positions = subview.template read<Position>();
+                        const EntityID* ids = subview.readId();
+                        for(unsigned i = 0; i<subview.size(); ++i){
+                                const uint64_t cell = cellKey(positions[i].x, positions[i].y, positions[i].z);
+                                entries[cellShard(cell)].push_back(CellEntry{cell, Entry{ids[i], positions[i].x, positions[i].y, positions[i].z}});
+                                located[entityShard(ids[i])].push_back(EntityCell{ids[i], cell});
+                        }
+                        std::lock_guard<std::mutex> lg(staging->lock);
+                        for(unsigned s = 0; s<SHARDS; ++s){
+                                staging->entries[s].insert(staging->entries[s].end(), entries[s].begin(), entries[s].end());
+                                staging->cells[s].insert(staging->cells[s].end(), located[s].begin(), located[s].end());
+                        }
+                }, dependency);
+                // The shard jobs hang off one empty job per SHARDS_PER_FAN_OUT shards rather than all off sorted,
+                // so no job gets more continuations than fit in it.
+                std::vector<JobHandle> shards;
+                for(unsigned group = 0; group<SHARDS; group += SHARDS_PER_FAN_OUT){
+                        const JobHandle fan_out = jobs.combine({sorted});
+                        for(unsigned s = group; s<group + SHARDS_PER_FAN_OUT; ++s){
+                                shards.push_back(jobs.schedule([this, staging, s]{
+                                        for(const CellEntry& staged : staging->entries[s]) cells[s][staged.cell].push_back(staged.entry);
+                                }, fan_out));
+                                shards.push_back(jobs.schedule([this, staging, s]{
+                                        entity_cells[s].reserve(staging->cells[s].size());
+                                        for(const EntityCell& staged : staging->cells[s]) entity_cells[s].emplace(staged.id, staged.cell);
+                                }, fan_out));
+                        }
+                }
+                shards.push_back(jobs.schedule([this, staging]{
+                        for(unsigned s = 0; s<SHARDS; ++s)
+                                for(const EntityCell& staged : staging->cells[s]) growBounds(staged.cell);
+                }, sorted));
+                return jobs.combine(shards);
+        }
+
+        inline size_t size() const {
+                size_t count = 0;
+                for(unsigned s = 0; s<SHARDS; ++s) count += entity_cells[s].size();
+                return count;
+        }
+
+        // Appends the entities within radius of point to found, as of the last update.
+        inline void queryRange(const Position& point, const float radius, std::vector<EntityID>& found) const {
+                const float squared_radius = radius*radius;
+                const auto check = [&](const Entry& entry){
+                        if(squaredDistance(entry, point) <= squared_radius) found.push_back(entry.id);
+                };
+                int32_t low[3] = {cellCoordinate(point.x - radius), cellCoordinate(point.y - radius), cellCoordinate(point.z - radius)};
+                int32_t high[3] = {cellCoordinate(point.x + radius), cellCoordinate(point.y + radius), cellCoordinate(point.z + radius)};
+                uint64_t visits = 1;
+                for(unsigned axis = 0; axis<3; ++axis){
+                        low[axis] = std::max(low[axis], bounds_min[axis]);
+                        high[axis] = std::min(high[axis], bounds_max[axis]);
+                        if(high[axis] < low[axis]) return;
+                        visits *= high[axis] - low[axis] + 1;
+                }
+                // Large ranges are cheaper to answer by walking the occupied cells.
+                uint64_t occupied = 0;
+                for(unsigned s = 0; s<SHARDS; ++s) occupied += cells[s].size();
+                if(occupied < visits){
+                        forEachCell(check);
+                        return;
+                }
+                for(int32_t x = low[0]; x<=high[0]; ++x)
+                        for(int32_t y = low[1]; y<=high[1]; ++y)
+                                for(int32_t z = low[2]; z<=high[2]; ++z) forEachInCell(x, y, z, check);
+        }
+
+        // The closest entity to point within max_distance other than exclude, searching rings of cells around
+        // point until no closer entity can be left. Returns false when there is none.
+        inline bool nearest(const Position& point, EntityID& found, const float max_distance = std::numeric_limits<float>::max(), const EntityID exclude = 0) const {
+                const float limit = max_distance < std::sqrt(std::numeric_limits<float>::max()) ? max_distance*max_distance : std::numeric_limits<float>::max();
+                float best = limit;
+                bool any = false;
+                const auto check = [&](const Entry& entry){
+                        const float distance = squaredDistance(entry, point);
+                        if(entry.id == exclude || best < distance) return;
+                        best = distance;
+                        found = entry.id;
+                        any = true;
+                };
+                const int32_t center[3] = {cellCoordinate(point.x), cellCoordinate(point.y), cellCoordinate(point.z)};
+                int32_t rings = -1;
+                for(unsigned axis = 0; axis<3; ++axis)
+                        rings = std::max({rings, center[axis] - bounds_min[axis], bounds_max[axis] - center[axis]});
+                uint64_t occupied = 0;
+                for(unsigned s = 0; s<SHARDS; ++s) occupied += cells[s].size();
+                uint64_t visited = 0;
+                for(int32_t ring = 0; ring<=rings; ++ring){
+                        // Everything from this ring on is at least ring - 1 cells away.
+                        const float closest = std::max(0, ring - 1)*cell_size;
+                        if(any && best <= closest*closest) break;
+                        const uint64_t side = 2*(uint64_t)ring + 1;
+                        const uint64_t inner_side = ring == 0 ? 0 : side - 2;
+                        visited += side*side*side - inner_side*inner_side*inner_side;
+                        // Once the rings cover more cells than are occupied walking the occupied ones is cheaper.
+                        if(occupied < visited){
+                                best = limit;
+                                any = false;
+                                forEachCell(check);
+                                return any;
+                        }
+                        const int32_t low[3] = {std::max(center[0] - ring, bounds_min[0]), std::max(center[1] - ring, bounds_min[1]), std::max(center[2] - ring, bounds_min[2])};
+                        const int32_t high[3] = {std::min(center[0] + ring, bounds_max[0]), std::min(center[1] + ring, bounds_max[1]), std::min(center[2] + ring, bounds_max[2])};
+                        for(int32_t x = low[0]; x<=high[0]; ++x){
+                                for(int32_t y = low[1]; y<=high[1]; ++y){
+                                        if(std::abs(x - center[0]) == ring || std::abs(y - center[1]) == ring){
+                                                for(int32_t z = low[2]; z<=high[2]; ++z) forEachInCell(x, y, z, check);
+                                                continue;
+                                        }
+                                        if(low[2] == center[2] - ring) forEachInCell(x, y, low[2], check);
+                                        if(high[2] == center[2] + ring && ring != 0) forEachInCell(x, y, high[2], check);
+                                }
+                        }
+                }
+                return any;
         }
-        inline void work(){
-                std::unique_lock<std::mutex> ul(queue_lock);
-                queue_not_empty.wait(ul, [this](){return queue_size != 0;});
-                auto job = queue_jobs[queue_front];
-                queue_front = (queue_front + 1) % JOBS_QUEUE_CAPACITY;
-                --queue_size;
-                ul.unlock();
-                queue_not_full.notify_one();
-                job();
-        }
-        JobSystem(bool mainThreadWillWork){
-                const auto ncores = std::thread::hardware_concurrency();
-                nworkers = (1u < ncores) ? ncores : 1u;
-                for (unsigned i = 0; i < nworkers; ++i){
-                        std::thread worker([this] () {
-                                while (true) this->work();
-                        });
-                        worker.detach();
-                }
-                if(mainThreadWillWork) nworkers += 1;
-                syncpoint_counter = nworkers;
-        }
-        ~JobSystem(){}
-        unsigned amountOfWorkers() const {return nworkers;}
-        
 };
 
 };
\ No newline at end of file
@@ -0,0 +1,504 @@
+// g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark
+// Add -mavx2 (or -march=native) to run the integration kernel on AVX2 instead of SSE.
+// ./benchmark [max_threads] > results.csv, one row per measurement.
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <utility>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "DOTS.hpp"
+
+// The mutex guarded ring of std::function the JobSystem used before the work-stealing queues. Its sync point
+// runs queued jobs while it waits like JobSystem::scheduleSyncPoint does, so both get the same threads.
+template<unsigned JOBS_QUEUE_CAPACITY>
+class LockedJobQueue{
+        std::function<void(void)> queue_jobs[JOBS_QUEUE_CAPACITY];
+        unsigned queue_front = 0;
+        unsigned queue_back = 0;
+        unsigned queue_size = 0;
+        std::mutex queue_lock;
+        std::condition_variable queue_not_full;
+        std::condition_variable queue_not_empty;
+        std::atomic<unsigned> unfinished_jobs{0};
+        bool running = true;
+        std::vector<std::thread> threads;
+
+        inline bool work(){
+                std::unique_lock<std::mutex> ul(queue_lock);
+                queue_not_empty.wait(ul, [this](){return queue_size != 0 || !running;});
+                return runFront(ul);
+        }
+        inline bool runFront(std::unique_lock<std::mutex>& ul){
+                if(queue_size == 0) return false;
+                auto job = queue_jobs[queue_front];
+                queue_front = (queue_front + 1) % JOBS_QUEUE_CAPACITY;
+                --queue_size;
+                ul.unlock();
+                queue_not_full.notify_one();
+                job();
+                unfinished_jobs.fetch_sub(1);
+                return true;
+        }
+        public:
+        inline void schedule(const std::function<void(void)>& job){
+                unfinished_jobs.fetch_add(1);
+                std::unique_lock<std::mutex> ul(queue_lock);
+                queue_not_full.wait(ul, [this](){return queue_size != JOBS_QUEUE_CAPACITY;});
+                queue_jobs[queue_back] = job;
+                queue_back = (queue_back + 1) % JOBS_QUEUE_CAPACITY;
+                ++queue_size;
+                ul.unlock();
+                queue_not_empty.notify_one();
+        }
+        inline void scheduleSyncPoint(){
+                while(unfinished_jobs.load() != 0){
+                        std::unique_lock<std::mutex> ul(queue_lock);
+                        if(!runFront(ul)) std::this_thread::yield();
+                }
+        }
+        LockedJobQueue(bool, unsigned workers){
+                for(unsigned i = 0; i<workers; ++i)
+                        threads.emplace_back([this]{while(this->work());});
+        }
+        ~LockedJobQueue(){
+                {
+                        std::lock_guard<std::mutex> lg(queue_lock);
+                        running = false;
+                }
+                queue_not_empty.notify_all();
+                for(auto& thread : threads) thread.join();
+        }
+};
+
+using Clock = std::chrono::steady_clock;
+
+static inline double secondsSince(Clock::time_point start){
+        return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static inline void report(const char* benchmark, const char* implementation, unsigned threads, unsigned items, double items_per_second){
+        std::cout<<benchmark<<","<<implementation<<","<<threads<<","<<items<<","<<items_per_second<<std::endl;
+}
+
+// Counts the jobs the scheduling thread ran itself while helping in scheduleSyncPoint.
+static thread_local bool is_producer = false;
+static std::atomic<unsigned> producer_jobs{0};
+
+// producer_share is the fraction of the jobs the scheduling thread ran.
+template<typename Jobs>
+double jobsPerSecond(unsigned threads, unsigned njobs, double& producer_share){
+        Jobs jobs(false, threads);
+        static std::atomic<unsigned> sink;
+        is_producer = true;
+        producer_jobs.store(0);
+        const auto start = Clock::now();
+        for(unsigned i = 0; i<njobs; ++i) jobs.schedule([i]{
+                unsigned x = i;
+                for(unsigned k = 0; k<64; ++k) x = x*1664525u + 1013904223u;
+                if(x == 0) sink.fetch_add(1, std::memory_order_relaxed);
+                if(is_producer) producer_jobs.fetch_add(1, std::memory_order_relaxed);
+        });
+        jobs.scheduleSyncPoint();
+        const double seconds = secondsSince(start);
+        is_producer = false;
+        producer_share = (double)producer_jobs.load()/njobs;
+        return njobs/seconds;
+}
+
+// Rounds of one small job per thread followed by a sync point, the inverse is the sync point latency.
+template<typename Jobs>
+double syncPointsPerSecond(unsigned threads, unsigned rounds){
+        Jobs jobs(false, threads);
+        static std::atomic<unsigned> sink;
+        const auto start = Clock::now();
+        for(unsigned r = 0; r<rounds; ++r){
+                for(unsigned t = 0; t<threads; ++t) jobs.schedule([]{sink.fetch_add(1, std::memory_order_relaxed);});
+                jobs.scheduleSyncPoint();
+        }
+        return rounds/secondsSince(start);
+}
+
+// Rounds of one job scheduled after the workers went idle, the inverse is the time until a worker starts it.
+double wakeupsPerSecond(unsigned threads, DOTS::IdleStrategy idle, unsigned rounds){
+        DOTS::JobSystemOptions options;
+        options.workers = threads;
+        options.idle = idle;
+        DOTS::JobSystem<1024> jobs(options);
+        std::atomic<int64_t> started{0};
+        double seconds = 0;
+        for(unsigned r = 0; r<rounds; ++r){
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                const auto scheduled = Clock::now();
+                started.store(0);
+                jobs.schedule([&started]{started.store(Clock::now().time_since_epoch().count());});
+                int64_t start;
+                while((start = started.load()) == 0) std::this_thread::yield();
+                seconds += std::chrono::duration<double>(Clock::time_point(Clock::duration(start)) - scheduled).count();
+        }
+        jobs.scheduleSyncPoint();
+        return rounds/seconds;
+}
+
+struct Position{
+        float x;
+        float y;
+        float z;
+};
+
+struct Velocity{
+        float x;
+        float y;
+        float z;
+};
+
+struct Health{
+        int value;
+};
+
+// Only used to split entities into different archetypes.
+template<unsigned N>
+struct Tag{
+        uint32_t value;
+};
+
+using World = DOTS::Entities<60000, 2000, 1024*16, Position, Velocity, Health>;
+using LargeWorld = DOTS::Entities<(1<<20), 8192, 1024*16, Position, Velocity, Tag<0>, Tag<1>, Tag<2>, Tag<3>>;
+
+// 150 component types, enough for archetype signatures wider than 64 bits.
+template<typename Indexes>
+struct WideWorldOf;
+template<unsigned... N>
+struct WideWorldOf<std::integer_sequence<unsigned, N...>>{
+        using type = DOTS::Entities<(1<<16), 2048, 1024*16, Position, Velocity, Tag<N>...>;
+};
+using WideWorld = WideWorldOf<std::make_integer_sequence<unsigned, 148>>::type;
+
+double createPerEntity(unsigned count){
+        auto world = std::make_unique<World>();
+        const auto start = Clock::now();
+        for(unsigned i = 0; i<count; ++i){
+                const auto id = world->createEntity();
+                world->addComponents(id, Position{(float)i, 0, 0}, Velocity{1, 0, 0});
+        }
+        return count/secondsSince(start);
+}
+
+double createFromArrays(unsigned count){
+        auto world = std::make_unique<World>();
+        std::vector<Position> positions(count);
+        std::vector<Velocity> velocities(count, Velocity{1, 0, 0});
+        for(unsigned i = 0; i<count; ++i) positions[i].x = i;
+        const auto start = Clock::now();
+        world->createEntities(count, nullptr, positions.data(), velocities.data());
+        return count/secondsSince(start);
+}
+
+double createWithInitializer(unsigned count){
+        auto world = std::make_unique<World>();
+        const auto start = Clock::now();
+        world->createEntities<Position, Velocity>(count, nullptr, [](unsigned i, Position& position, Velocity& velocity){
+                position.x = i;
+                velocity.x = 1;
+        });
+        return count/secondsSince(start);
+}
+
+// Creating and destroying count entities, two operations each.
+double createDestroyPerSecond(unsigned count){
+        auto world = std::make_unique<World>();
+        std::vector<DOTS::EntityID> ids(count);
+        const auto start = Clock::now();
+        for(unsigned i = 0; i<count; ++i){
+                ids[i] = world->createEntity();
+                world->addComponents(ids[i], Position{(float)i, 0, 0}, Velocity{1, 0, 0});
+        }
+        for(unsigned i = 0; i<count; ++i) world->destroyEntity(ids[i]);
+        return 2.0*count/secondsSince(start);
+}
+
+// Moves count entities to the archetype with Health and back, two transfers each.
+double transfersPerSecond(unsigned count){
+        auto world = std::make_unique<World>();
+        std::vector<DOTS::EntityID> ids(count);
+        world->createEntities<Position, Velocity>(count, ids.data(), [](unsigned i, Position& position, Velocity& velocity){
+                position.x = i;
+        });
+        const auto start = Clock::now();
+        for(unsigned i = 0; i<count; ++i) world->addComponents(ids[i], Health{100});
+        for(unsigned i = 0; i<count; ++i) world->delComponents<Health>(ids[i]);
+        return 2.0*count/secondsSince(start);
+}
+
+// Plays back a buffer creating count entities with Position and Velocity, moving count others to the archetype
+// with Tag<1> and destroying them, three commands per entity.
+template<typename Entities>
+double playbackPerSecond(unsigned count){
+        auto world = std::make_unique<Entities>();
+        std::vector<DOTS::EntityID> ids(count);
+        world->template createEntities<Position, Velocity>(count, ids.data(), [](unsigned i, Position& position, Velocity& velocity){
+                position.x = i;
+        });
+        typename Entities::CommandBuffer buffer;
+        for(unsigned i = 0; i<count; ++i){
+                const auto id = buffer.createEntity();
+                buffer.addComponents(id, Position{(float)i, 0, 0}, Velocity{1, 0, 0});
+                buffer.addComponents(ids[i], Tag<1>{});
+                buffer.destroyEntity(ids[i]);
+        }
+        const auto start = Clock::now();
+        world->playback(buffer);
+        return 3.0*count/secondsSince(start);
+}
+
+// Saves count entities spread over 16 archetypes to a snapshot and loads it into another world. The load is
+// timed alone, when chunks are mapped their pages are only read in once touched, and then together with
+// reading every position.
+void snapshotPerSecond(unsigned count, double& saves, double& loads, double& touched_loads, double& checkpoints){
+        const char* path = "benchmark.snapshot";
+        auto world = std::make_unique<LargeWorld>();
+        std::vector<DOTS::EntityID> ids(count);
+        world->createEntities<Position, Velocity>(count, ids.data(), [](unsigned i, Position& position, Velocity& velocity){
+                position.x = i;
+        });
+        for(unsigned i = 0; i<count; ++i){
+                if(i & 1) world->addComponents(ids[i], Tag<0>{});
+                if(i & 2) world->addComponents(ids[i], Tag<1>{});
+                if(i & 4) world->addComponents(ids[i], Tag<2>{});
+                if(i & 8) world->addComponents(ids[i], Tag<3>{});
+        }
+        auto start = Clock::now();
+        world->save(path);
+        saves = count/secondsSince(start);
+        world.reset();
+        auto loaded = std::make_unique<LargeWorld>();
+        start = Clock::now();
+        loaded->load(path);
+        loads = count/secondsSince(start);
+        start = Clock::now();
+        loaded->load(path);
+        float checksum = 0;
+        for(auto subview : loaded->select<Position>())
+                for(unsigned i = 0; i<subview.size(); ++i) checksum += subview.read<Position>()[i].x;
+        touched_loads = count/secondsSince(start);
+        // Saves back over the file the chunks are still mapped from.
+        start = Clock::now();
+        loaded->save(path);
+        checkpoints = count/secondsSince(start);
+        loaded->load(path);
+        float reloaded_checksum = 0;
+        unsigned reloaded = 0;
+        for(auto subview : loaded->select<Position>()){
+                for(unsigned i = 0; i<subview.size(); ++i) reloaded_checksum += subview.read<Position>()[i].x;
+                reloaded += subview.size();
+        }
+        if(reloaded_checksum != checksum || reloaded != count) throw std::runtime_error("Checkpoint does not match the snapshot!");
+        if(checksum < 0) std::cerr<<checksum;
+        std::remove(path);
+}
+
+// Spreads count entities over archetypes archetypes, up to 16, and integrates their positions.
+double iterationPerSecond(unsigned count, unsigned archetypes){
+        auto world = std::make_unique<LargeWorld>();
+        std::vector<DOTS::EntityID> ids(count);
+        world->createEntities<Position, Velocity>(count, ids.data(), [](unsigned i, Position& position, Velocity& velocity){
+                velocity = Velocity{1, 2, 3};
+        });
+        for(unsigned i = 0; i<count; ++i){
+                const unsigned archetype = i%archetypes;
+                if(archetype & 1) world->addComponents(ids[i], Tag<0>{});
+                if(archetype & 2) world->addComponents(ids[i], Tag<1>{});
+                if(archetype & 4) world->addComponents(ids[i], Tag<2>{});
+                if(archetype & 8) world->addComponents(ids[i], Tag<3>{});
+        }
+        const unsigned iterations = std::max(1u, 20000000/count);
+        auto view = world->select<Position, Velocity>();
+        const auto start = Clock::now();
+        for(unsigned k = 0; k<iterations; ++k){
+                for(auto subview : view){
+                        Position* position = subview.write<Position>();
+                        const Velocity* velocity = subview.read<Velocity>();
+                        for(unsigned i = 0; i<subview.size(); ++i){
+                                position[i].x += velocity[i].x*0.016f;
+                                position[i].y += velocity[i].y*0.016f;
+                                position[i].z += velocity[i].z*0.016f;
+                        }
+                }
+        }
+        return (double)count*iterations/secondsSince(start);
+}
+
+// One neighbourhood query of radius 2 per entity, count entities spread in a 100^3 box, checking every
+// other entity or asking a SpatialGrid rebuilt up front.
+double neighbourQueriesPerSecond(unsigned count, bool grid){
+        auto world = std::make_unique<World>();
+        uint32_t seed = 1;
+        const auto next = [&seed]{
+                seed = seed*1664525u + 1013904223u;
+                return (seed >> 8)*(100.0f/(1 << 24));
+        };
+        world->createEntities<Position>(count, nullptr, [&next](unsigned i, Position& position){
+                position = Position{next(), next(), next()};
+        });
+        std::vector<Position> positions;
+        for(auto subview : world->select<const Position>())
+                positions.insert(positions.end(), subview.read<Position>(), subview.read<Position>() + subview.size());
+        DOTS::SpatialGrid<World, Position> spatial(2);
+        spatial.update(*world);
+        std::vector<DOTS::EntityID> found;
+        size_t total = 0;
+        const auto start = Clock::now();
+        for(const Position& position : positions){
+                found.clear();
+                if(grid) spatial.queryRange(position, 2, found);
+                else{
+                        for(auto subview : world->select<const Position>()){
+                                const Position* others = subview.read<Position>();
+                                for(unsigned i = 0; i<subview.size(); ++i){
+                                        const float dx = others[i].x - position.x, dy = others[i].y - position.y, dz = others[i].z - position.z;
+                                        if(dx*dx + dy*dy + dz*dz <= 4) found.push_back(subview.readId()[i]);
+                                }
+                        }
+                }
+                total += found.size();
+        }
+        const double seconds = secondsSince(start);
+        if(total == 0) std::cerr<<total;
+        return count/seconds;
+}
+
+double spatialRebuildsPerSecond(unsigned threads, unsigned count, unsigned rounds){
+        auto world = std::make_unique<World>();
+        world->createEntities<Position>(count, nullptr, [](unsigned i, Position& position){
+                position = Position{(float)(i%97), (float)(i%89), (float)(i%83)};
+        });
+        DOTS::JobSystem<1024> jobs(true, threads);
+        DOTS::SpatialGrid<World, Position> spatial(2);
+        const auto start = Clock::now();
+        for(unsigned k = 0; k<rounds; ++k) jobs.complete(spatial.rebuild(*world, jobs));
+        return (double)count*rounds/secondsSince(start);
+}
+
+// One View job scheduled from every batch of a parallelForChunks over count entities, with a queue smaller
+// than the amount of jobs so scheduling overflows it while the batches run.
+double nestedSchedulesPerSecond(unsigned threads, unsigned count){
+        auto world = std::make_unique<World>();
+        world->createEntities<Position, Velocity>(count, nullptr, [](unsigned i, Position& position, Velocity& velocity){
+                position.x = i;
+        });
+        DOTS::JobSystem<64> jobs(false, threads);
+        std::atomic<unsigned> batches{0};
+        std::atomic<unsigned> nested{0};
+        const unsigned batch_size = 16;
+        const auto start = Clock::now();
+        World* entities = world.get();
+        jobs.complete(world->select<Velocity, const Position>().parallelForChunks(jobs, [entities, &jobs, &batches, &nested](const World::View<Velocity, const Position>::SubView& subview){
+                batches.fetch_add(1, std::memory_order_relaxed);
+                entities->select<const Position>().schedule(jobs, [&nested](const World::View<const Position>& view){
+                        nested.fetch_add(1, std::memory_order_relaxed);
+                });
+        }, DOTS::JobHandle(), batch_size));
+        world->completeJobs(jobs);
+        const double seconds = secondsSince(start);
+        if(nested.load() != batches.load() || nested.load() < count/batch_size) throw std::runtime_error("Nested View jobs went missing!");
+        return nested.load()/seconds;
+}
+
+// Position and Velocity are three floats each, so a chunk's columns are just two float arrays of 3*size
+// elements that can be integrated as flat arrays.
+static inline void integrateScalar(const World::View<Position, Velocity>::SubView& subview, const float dt){
+        Position* position = subview.write<Position>();
+        const Velocity* velocity = subview.read<Velocity>();
+        for(unsigned i = 0; i<subview.size(); ++i){
+                position[i].x += velocity[i].x*dt;
+                position[i].y += velocity[i].y*dt;
+                position[i].z += velocity[i].z*dt;
+        }
+}
+
+// Runs over paddedSize() rows with aligned loads, COLUMN_ROWS_MULTIPLE rows of 12 bytes are a whole number of vectors.
+static inline void integrateSimd(const World::View<Position, Velocity>::SubView& subview, const float dt){
+        float* position = (float*)subview.write<Position>();
+        const float* velocity = (const float*)subview.read<Velocity>();
+        const unsigned n = 3*subview.paddedSize();
+        unsigned i = 0;
+#if defined(__AVX2__)
+        const __m256 step = _mm256_set1_ps(dt);
+        for(; i + 8<=n; i += 8) _mm256_store_ps(position + i, _mm256_add_ps(_mm256_load_ps(position + i), _mm256_mul_ps(_mm256_load_ps(velocity + i), step)));
+#elif defined(__SSE2__)
+        const __m128 step = _mm_set1_ps(dt);
+        for(; i + 4<=n; i += 4) _mm_store_ps(position + i, _mm_add_ps(_mm_load_ps(position + i), _mm_mul_ps(_mm_load_ps(velocity + i), step)));
+#endif
+        for(; i<n; ++i) position[i] += velocity[i]*dt;
+}
+
+template<typename Kernel>
+double integratePerSecond(unsigned count, unsigned iterations, const Kernel& kernel){
+        auto world = std::make_unique<World>();
+        world->createEntities<Position, Velocity>(count, nullptr, [](unsigned i, Position& position, Velocity& velocity){
+                position.x = i;
+                velocity = Velocity{1, 2, 3};
+        });
+        auto view = world->select<Position, Velocity>();
+        const auto start = Clock::now();
+        for(unsigned k = 0; k<iterations; ++k)
+                for(auto subview : view) kernel(subview, 0.016f);
+        const double seconds = secondsSince(start);
+        float checksum = 0;
+        for(auto subview : view) checksum += subview.read<Position>()[0].y;
+        if(checksum < 0) std::cerr<<checksum;
+        return (double)count*iterations/seconds;
+}
+
+int main(int argc, char** argv){
+        const unsigned hardware = std::thread::hardware_concurrency();
+        const unsigned max_threads = (1 < argc) ? std::atoi(argv[1]) : (1u < hardware ? hardware : 1u);
+        const unsigned njobs = 200000;
+        const unsigned nsyncs = 20000;
+        const unsigned nentities = 50000;
+        std::cout<<"benchmark,implementation,threads,items,items_per_second"<<std::endl;
+        report("create_entities", "per_entity", 1, nentities, createPerEntity(nentities));
+        report("create_entities", "bulk_arrays", 1, nentities, createFromArrays(nentities));
+        report("create_entities", "bulk_initializer", 1, nentities, createWithInitializer(nentities));
+        report("create_destroy", "per_entity", 1, nentities, createDestroyPerSecond(nentities));
+        report("transfer", "add_del_components", 1, nentities, transfersPerSecond(nentities));
+        report("playback", "narrow_signature", 1, 20000, playbackPerSecond<LargeWorld>(20000));
+        report("playback", "wide_signature", 1, 20000, playbackPerSecond<WideWorld>(20000));
+        double saves, loads, touched_loads, checkpoints;
+        snapshotPerSecond(1000000, saves, loads, touched_loads, checkpoints);
+        report("snapshot", "save", 1, 1000000, saves);
+        report("snapshot", "load", 1, 1000000, loads);
+        report("snapshot", "load_and_read", 1, 1000000, touched_loads);
+        report("snapshot", "save_over_loaded", 1, 1000000, checkpoints);
+        for(const unsigned archetypes : {1u, 4u, 16u}){
+                const std::string implementation = "archetypes_" + std::to_string(archetypes);
+                for(const unsigned count : {1000u, 10000u, 100000u, 1000000u})
+                        report("iterate", implementation.c_str(), 1, count, iterationPerSecond(count, archetypes));
+        }
+        report("integrate", "scalar", 1, nentities, integratePerSecond(nentities, 200, integrateScalar));
+#if defined(__AVX2__)
+        report("integrate", "avx2", 1, nentities, integratePerSecond(nentities, 200, integrateSimd));
+#elif defined(__SSE2__)
+        report("integrate", "sse2", 1, nentities, integratePerSecond(nentities, 200, integrateSimd));
+#endif
+        report("neighbour_query", "brute_force", 1, 10000, neighbourQueriesPerSecond(10000, false));
+        report("neighbour_query", "spatial_grid", 1, 10000, neighbourQueriesPerSecond(10000, true));
+        for(unsigned threads = 1; threads<=max_threads; ++threads){
+                report("spatial_rebuild", "parallel", threads, nentities, spatialRebuildsPerSecond(threads, nentities, 20));
+                report("schedule", "nested_view_jobs", threads, nentities/16, nestedSchedulesPerSecond(threads, nentities));
+                report("wakeup", "idle_spin", threads, 200, wakeupsPerSecond(threads, DOTS::IDLE_SPIN, 200));
+                report("wakeup", "idle_yield", threads, 200, wakeupsPerSecond(threads, DOTS::IDLE_YIELD, 200));
+                report("wakeup", "idle_park", threads, 200, wakeupsPerSecond(threads, DOTS::IDLE_PARK, 200));
+                double locked_share, stealing_share;
+                report("schedule", "locked_queue", threads, njobs, jobsPerSecond<LockedJobQueue<1024>>(threads, njobs, locked_share));
+                report("schedule", "work_stealing", threads, njobs, jobsPerSecond<DOTS::JobSystem<1024>>(threads, njobs, stealing_share));
+                report("schedule_producer_share", "locked_queue", threads, njobs, locked_share);
+                report("schedule_producer_share", "work_stealing", threads, njobs, stealing_share);
+                report("sync_point", "locked_queue", threads, nsyncs, syncPointsPerSecond<LockedJobQueue<1024>>(threads, nsyncs));
+                report("sync_point", "work_stealing", threads, nsyncs, syncPointsPerSecond<DOTS::JobSystem<1024>>(threads, nsyncs));
+        }
+        return 0;
+}
@@ -18,7 +18,8 @@ struct Health{
         unsigned value;
 };
 
-DOTS::Entities<1000, 100, 1024*16, Position, Velocity, Health> e;
+using World = DOTS::Entities<1000, 100, 1024*16, Position, Velocity, Health>;
+World e;
 DOTS::JobSystem<64> j(false);
 
 int main(){
@@ -31,20 +32,16 @@ int main(){
         e.addComponents(first, Velocity{1,1,1});
         e.addComponents(third, Position{1, 2, 3});
         e.delComponents<Velocity>(second);
-        for(auto subview : e.select<Position, Velocity>()) j.schedule([subview]{
-                const auto size = subview.size();
-                auto positions = subview.write<Position>();
-                auto velocities = subview.read<Velocity>();
-                for(unsigned i = 0; i<size; ++i){
-                       positions[i].x += velocities[i].x;
-                       positions[i].y += velocities[i].y;
-                       positions[i].z += velocities[i].z;
-                }
+        e.select<Position, const Velocity>().parallelForEach(j, [](Position& position, const Velocity& velocity){
+                position.x += velocity.x;
+                position.y += velocity.y;
+                position.z += velocity.z;
         });
         //e.destroyEntity(third);
         //e.delComponents<Position>(third);
-        j.scheduleNotConcurrent([]{
-                for(auto subview : e.select<Position>()){
+        // Runs after the move job, the View reads Position which that job writes.
+        auto print = e.select<const Position>().schedule(j, [](const World::View<const Position>& view){
+                for(auto subview : view){
                         auto size = subview.size();
                         auto positions = subview.read<Position>();
                         auto ids = subview.readId();
@@ -53,6 +50,16 @@ int main(){
                         }
                 }
         });
+        j.complete(print);
+        // Taken once the move job is complete, so only writes after it count as changes.
+        const uint32_t moved = e.nextChangeVersion();
+        unsigned unchanged = 0;
+        for(auto subview : e.select<const Position>().changedSince(moved)) unchanged += subview.size();
+        e.addComponents(first, Health{100});
+        unsigned changed = 0;
+        for(auto subview : e.select<const Position>().changedSince(moved)) changed += subview.size();
+        if(unchanged != 0 || changed != 1) throw std::runtime_error("changedSince returned the wrong chunks!");
+        std::cout<<"Entities changed since the move: "<<changed<<std::endl;
         int i;
         while (true){
                 std::cin >> i;